@@ -0,0 +1 @@
+#include "analysis.h"
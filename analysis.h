@@ -0,0 +1,605 @@
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ir.h"
+
+// Data flow analyses on the IR, shared by the passes
+
+// What calls to the user functions of a module may do, computed by summaries (below). The analyses take it optionally,
+// without it a call may read and write every register and every privileged address.
+class call_effects {
+public:
+    struct summary {
+        std::set<int> uses;        // registers read before they are written
+        std::set<int> clobbers;    // registers written, including the call sequence
+        std::set<uint64_t> reads;  // privileged addresses that may be loaded
+        std::set<uint64_t> writes; // privileged addresses that may be stored
+        bool stores = false;       // stores to any memory, e.g. the stack
+        bool syscalls = false;
+
+        // no effect besides the registers it clobbers
+        bool pure() const {
+            return !stores && !syscalls;
+        }
+
+        bool operator==(const summary &) const = default;
+    };
+
+    std::unordered_map<std::string, summary> functions; // includes the effects of the callees
+
+    // the summary of the callee, nullptr if the instruction is no call or the callee is unknown
+    const summary *find(const ir::Instr &instr) const {
+        if (instr.op != ir::CALL) {
+            return nullptr;
+        }
+        auto found = functions.find(instr.symbol);
+        return found == functions.end() ? nullptr : &found->second;
+    }
+
+    // false if the instruction is a call that cannot store to the privileged address
+    bool may_write(const ir::Instr &instr, uint64_t address) const {
+        const summary *callee = find(instr);
+        return !callee || callee->writes.contains(address);
+    }
+
+    // ir::uses, narrowed to the summary for calls
+    static std::vector<int> uses(const ir::Instr &instr, const call_effects *calls) {
+        const summary *callee = calls ? calls->find(instr) : nullptr;
+        return callee ? std::vector<int>(callee->uses.begin(), callee->uses.end()) : ir::uses(instr);
+    }
+
+    // ir::defs, narrowed to the summary for calls
+    static std::vector<int> defs(const ir::Instr &instr, const call_effects *calls) {
+        const summary *callee = calls ? calls->find(instr) : nullptr;
+        return callee ? std::vector<int>(callee->clobbers.begin(), callee->clobbers.end()) : ir::defs(instr);
+    }
+};
+
+// Forward analysis of the registers that hold a known constant (from li, folded through add/sub/mul/cmpGT).
+// Addresses of privileged objects, request windows and syscall arguments are all found this way.
+class constants {
+public:
+    using State = std::unordered_map<int, uint64_t>; // register -> value, missing registers are unknown
+
+    std::vector<State> in;       // state at the start of every block
+    std::vector<bool> reachable; // false for blocks that are never entered
+    const call_effects *calls;
+
+    explicit constants(const ir::Function &function) : constants(function, ir::CFG(function)) {}
+
+    constants(const ir::Function &function, const ir::CFG &cfg, const call_effects *calls = nullptr) : calls(calls) {
+        size_t n = function.blocks.size();
+        in.resize(n);
+        reachable.assign(n, false);
+        if (n == 0) {
+            return;
+        }
+        reachable[0] = true;
+        std::vector<State> out(n);
+        std::vector<bool> visited(n, false);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = 0; b < n; b++) {
+                State state;
+                bool first = true;
+                if (b == 0) {
+                    first = false; // the entry starts with nothing known
+                }
+                for (size_t p : cfg.predecessors[b]) {
+                    if (!visited[p]) {
+                        continue;
+                    }
+                    if (first) {
+                        state = out[p];
+                        first = false;
+                    } else {
+                        meet(state, out[p]);
+                    }
+                }
+                if (first) {
+                    continue; // not reached (yet)
+                }
+                reachable[b] = true;
+                in[b] = state;
+                for (const auto &instr : function.blocks[b].instrs) {
+                    step(instr, state, calls);
+                }
+                if (!visited[b] || state != out[b]) {
+                    out[b] = std::move(state);
+                    visited[b] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // keeps the registers that have the same value in both states
+    static void meet(State &state, const State &other) {
+        for (auto it = state.begin(); it != state.end();) {
+            auto found = other.find(it->first);
+            if (found == other.end() || found->second != it->second) {
+                it = state.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    static std::optional<uint64_t> value(const State &state, int reg) {
+        auto found = state.find(reg);
+        if (found == state.end()) {
+            return std::nullopt;
+        }
+        return found->second;
+    }
+
+    // applies the effect of one instruction to the state
+    static void step(const ir::Instr &instr, State &state, const call_effects *calls = nullptr) {
+        std::optional<uint64_t> result;
+        uint64_t lhs = 0, rhs = 0;
+        bool known = false;
+        if (instr.reg[0] >= 0 && instr.reg[1] >= 0 && state.contains(instr.reg[0]) && state.contains(instr.reg[1])) {
+            lhs = state.at(instr.reg[0]);
+            rhs = state.at(instr.reg[1]);
+            known = true;
+        }
+        switch (instr.op) {
+            case ir::LI:
+                if (instr.symbol.empty()) {
+                    result = instr.imm;
+                }
+                break;
+            case ir::ADD:
+                if (known) result = lhs + rhs;
+                break;
+            case ir::SUB:
+                if (known) result = lhs - rhs;
+                break;
+            case ir::MUL:
+                if (known) result = lhs * rhs;
+                break;
+            case ir::CMP_GT:
+                if (known) result = lhs > rhs ? 1 : 0;
+                break;
+            default:
+                break;
+        }
+        for (int reg : call_effects::defs(instr, calls)) {
+            state.erase(reg);
+        }
+        if (result) {
+            state[ir::defs(instr)[0]] = *result;
+        }
+    }
+
+    // the state before every instruction of a block
+    std::vector<State> states(const ir::Function &function, size_t block) const {
+        std::vector<State> result;
+        State state = in[block];
+        for (const auto &instr : function.blocks[block].instrs) {
+            result.push_back(state);
+            step(instr, state, calls);
+        }
+        return result;
+    }
+};
+
+// Backward analysis of the registers that are read before they are written again.
+class liveness {
+public:
+    using Set = std::unordered_set<int>;
+
+    std::vector<Set> live_in;
+    std::vector<Set> live_out;
+    const call_effects *calls;
+
+    explicit liveness(const ir::Function &function) : liveness(function, ir::CFG(function)) {}
+
+    liveness(const ir::Function &function, const ir::CFG &cfg, const call_effects *calls = nullptr) : calls(calls) {
+        size_t n = function.blocks.size();
+        live_in.resize(n);
+        live_out.resize(n);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = n; b-- > 0;) {
+                Set out;
+                for (size_t s : cfg.successors[b]) {
+                    out.insert(live_in[s].begin(), live_in[s].end());
+                }
+                Set live = out;
+                const auto &instrs = function.blocks[b].instrs;
+                for (size_t i = instrs.size(); i-- > 0;) {
+                    step(instrs[i], live, calls);
+                }
+                if (live != live_in[b] || out != live_out[b]) {
+                    live_in[b] = std::move(live);
+                    live_out[b] = std::move(out);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // turns the registers live after the instruction into the ones live before it
+    static void step(const ir::Instr &instr, Set &live, const call_effects *calls = nullptr) {
+        for (int reg : call_effects::defs(instr, calls)) {
+            live.erase(reg);
+        }
+        for (int reg : call_effects::uses(instr, calls)) {
+            live.insert(reg);
+        }
+    }
+
+    // the registers live after every instruction of a block
+    std::vector<Set> live_after(const ir::Function &function, size_t block) const {
+        const auto &instrs = function.blocks[block].instrs;
+        std::vector<Set> result(instrs.size());
+        Set live = live_out[block];
+        for (size_t i = instrs.size(); i-- > 0;) {
+            result[i] = live;
+            step(instrs[i], live, calls);
+        }
+        return result;
+    }
+};
+
+// Dominator sets of the blocks: a block d dominates b if every path from the entry to b passes d.
+class dominators {
+public:
+    std::vector<std::vector<bool>> dom; // dom[b][d] is true if d dominates b
+
+    explicit dominators(const ir::CFG &cfg) {
+        size_t n = cfg.successors.size();
+        dom.assign(n, std::vector<bool>(n, true));
+        if (n == 0) {
+            return;
+        }
+        dom[0].assign(n, false);
+        dom[0][0] = true;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = 1; b < n; b++) {
+                std::vector<bool> result(n, true);
+                for (size_t p : cfg.predecessors[b]) {
+                    for (size_t d = 0; d < n; d++) {
+                        result[d] = result[d] && dom[p][d];
+                    }
+                }
+                result[b] = true;
+                if (result != dom[b]) {
+                    dom[b] = std::move(result);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    bool dominates(size_t d, size_t b) const {
+        return dom[b][d];
+    }
+};
+
+// Post-dominators of the blocks of a function: p post-dominates b if every path from b to the end of the function
+// (a block without successors) passes p
+class post_dominators {
+public:
+    std::vector<std::vector<bool>> pdom; // pdom[b][p] is true if p post-dominates b
+
+    explicit post_dominators(const ir::CFG &cfg) {
+        size_t n = cfg.successors.size();
+        pdom.assign(n, std::vector<bool>(n, true));
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = n; b-- > 0;) {
+                std::vector<bool> result(n, !cfg.successors[b].empty());
+                for (size_t s : cfg.successors[b]) {
+                    for (size_t p = 0; p < n; p++) {
+                        result[p] = result[p] && pdom[s][p];
+                    }
+                }
+                result[b] = true;
+                if (result != pdom[b]) {
+                    pdom[b] = std::move(result);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    bool post_dominates(size_t p, size_t b) const {
+        return pdom[b][p];
+    }
+};
+
+// Memory effects of syscalls, from the known values of the syscall number and argument registers (see constants).
+// The numbers are the ones the transpiler emits, the arguments are in registers 0 to 2:
+//
+//     open 0 (path), write 1 (fd, buffer, count): only read memory
+//     read 2 (fd, buffer, count):                 writes [buffer, buffer + count)
+//     ioctl 3 (fd, request, argument):            may write anything from argument on
+//
+// Unknown numbers and unknown buffers may write any address.
+class syscalls {
+public:
+    enum Number : uint64_t {
+        OPEN = 0,
+        WRITE = 1,
+        READ = 2,
+        IOCTL = 3
+    };
+
+    /*
+     * @param state - the known registers before the syscall
+     * @return bool - false if the syscall cannot write the address
+     */
+    static bool may_write(const ir::Instr &syscall, const constants::State &state, uint64_t address) {
+        auto number = constants::value(state, syscall.reg[0]);
+        if (!number) {
+            return true;
+        }
+        switch (*number) {
+            case OPEN:
+            case WRITE:
+                return false;
+            case READ: {
+                auto buffer = constants::value(state, 1);
+                auto count = constants::value(state, 2);
+                return !buffer || (address >= *buffer && (!count || address - *buffer < *count));
+            }
+            case IOCTL: {
+                auto argument = constants::value(state, 2);
+                return !argument || address >= *argument;
+            }
+            default:
+                return true;
+        }
+    }
+
+    /*
+     * @param state - the known registers before the syscall
+     * @return bool - false if the syscall cannot read the address
+     */
+    static bool may_read(const ir::Instr &syscall, const constants::State &state, uint64_t address) {
+        auto number = constants::value(state, syscall.reg[0]);
+        if (!number) {
+            return true;
+        }
+        switch (*number) {
+            case READ:
+                return false;
+            case WRITE: {
+                auto buffer = constants::value(state, 1);
+                auto count = constants::value(state, 2);
+                return !buffer || (address >= *buffer && (!count || address - *buffer < *count));
+            }
+            case IOCTL: {
+                auto argument = constants::value(state, 2);
+                return !argument || address >= *argument;
+            }
+            default:
+                return true; // open reads a path of unknown length
+        }
+    }
+};
+
+// Forward analysis of the privileged values that are still held in a register after a load or store of their address.
+// A value stays available until its register is written, a store may change its address, or a syscall (see syscalls) or
+// call (see call_effects) may write it.
+class availability {
+public:
+    using State = std::map<uint64_t, int>; // address -> register holding the current value
+
+    std::vector<State> in; // state at the start of every block
+
+    availability(const ir::Function &function, const ir::CFG &cfg, const constants &consts,
+                 const std::set<uint64_t> &addresses, const call_effects *calls = nullptr) {
+        size_t n = function.blocks.size();
+        in.resize(n);
+        std::vector<State> out(n);
+        std::vector<bool> visited(n, false);
+        std::vector<std::vector<constants::State>> states(n);
+        for (size_t b = 0; b < n; b++) {
+            states[b] = consts.states(function, b);
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = 0; b < n; b++) {
+                State state;
+                bool first = b != 0; // nothing is available at the entry
+                for (size_t p : cfg.predecessors[b]) {
+                    if (!visited[p]) {
+                        continue;
+                    }
+                    if (first) {
+                        state = out[p];
+                        first = false;
+                    } else {
+                        meet(state, out[p]);
+                    }
+                }
+                if (first) {
+                    continue; // not reached (yet)
+                }
+                in[b] = state;
+                const auto &instrs = function.blocks[b].instrs;
+                for (size_t i = 0; i < instrs.size(); i++) {
+                    step(instrs[i], states[b][i], addresses, state, calls);
+                }
+                if (!visited[b] || state != out[b]) {
+                    out[b] = std::move(state);
+                    visited[b] = true;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // keeps the addresses that are held in the same register in both states
+    static void meet(State &state, const State &other) {
+        for (auto it = state.begin(); it != state.end();) {
+            auto found = other.find(it->first);
+            if (found == other.end() || found->second != it->second) {
+                it = state.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    /*
+     * Applies the effect of one instruction to the state
+     * @param consts - the known registers before the instruction
+     * @param addresses - the privileged addresses that are tracked
+     */
+    static void step(const ir::Instr &instr, const constants::State &consts, const std::set<uint64_t> &addresses,
+                     State &state, const call_effects *calls = nullptr) {
+        if (instr.op == ir::CALL) {
+            std::erase_if(state, [&](const auto &entry) { return !calls || calls->may_write(instr, entry.first); });
+        }
+        if (instr.op == ir::SYSCALL) {
+            std::erase_if(state, [&](const auto &entry) { return syscalls::may_write(instr, consts, entry.first); });
+        }
+        std::optional<uint64_t> addr;
+        if (instr.op == ir::LOAD || instr.op == ir::STORE) {
+            addr = constants::value(consts, instr.reg[0]);
+            if (!addr && instr.op == ir::STORE) {
+                state.clear(); // the store may write any address
+                return;
+            }
+        }
+        for (int reg : call_effects::defs(instr, calls)) {
+            std::erase_if(state, [reg](const auto &entry) { return entry.second == reg; });
+        }
+        if (addr && addresses.contains(*addr)) {
+            if (instr.op == ir::STORE) {
+                state[*addr] = instr.reg[1];
+            } else {
+                state.emplace(*addr, instr.reg[1]); // a register that already holds the value keeps it longer
+            }
+        }
+    }
+};
+
+// Side effects of the user functions of a module (see call_effects), iterated over the call graph to a fixpoint.
+// Summaries start empty and only grow, so recursive functions converge; calls to functions outside the module keep the
+// conservative view.
+class summaries {
+public:
+    static call_effects compute(const ir::Module &module) {
+        std::set<uint64_t> privileged;
+        for (const auto &[name, addr] : module.privileged) {
+            privileged.insert(addr);
+        }
+        call_effects result;
+        for (const auto &function : module.functions) {
+            result.functions[function.name] = {};
+        }
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (const auto &function : module.functions) {
+                call_effects::summary summary = summarize(function, privileged, result);
+                call_effects::summary &old = result.functions[function.name];
+                merge(summary, old);
+                if (summary != old) {
+                    old = std::move(summary);
+                    changed = true;
+                }
+            }
+        }
+        return result;
+    }
+
+    static void merge(call_effects::summary &summary, const call_effects::summary &other) {
+        summary.uses.insert(other.uses.begin(), other.uses.end());
+        summary.clobbers.insert(other.clobbers.begin(), other.clobbers.end());
+        summary.reads.insert(other.reads.begin(), other.reads.end());
+        summary.writes.insert(other.writes.begin(), other.writes.end());
+        summary.stores = summary.stores || other.stores;
+        summary.syscalls = summary.syscalls || other.syscalls;
+    }
+
+    /*
+     * Summarizes one function, using the current summaries for its calls
+     * @param privileged - the privileged addresses of the module
+     */
+    static call_effects::summary summarize(const ir::Function &function, const std::set<uint64_t> &privileged,
+                                           const call_effects &calls) {
+        call_effects::summary summary;
+        // the call sequence sets registers 0, 1 and the return address before the function runs, ret sets 1 again
+        summary.clobbers = {0, 1, ir::RETURN_ADDRESS};
+        ir::CFG cfg(function);
+        constants consts(function, cfg, &calls);
+        liveness live(function, cfg, &calls);
+        if (!function.blocks.empty()) {
+            for (int reg : live.live_in[0]) {
+                if (reg != 0 && reg != 1 && reg != ir::RETURN_ADDRESS) {
+                    summary.uses.insert(reg);
+                }
+            }
+        }
+        auto access = [&](std::set<uint64_t> &addresses, std::optional<uint64_t> addr) {
+            if (!addr) {
+                addresses.insert(privileged.begin(), privileged.end());
+            } else if (privileged.contains(*addr)) {
+                addresses.insert(*addr);
+            }
+        };
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            auto states = consts.states(function, b);
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = 0; i < instrs.size(); i++) {
+                const ir::Instr &instr = instrs[i];
+                for (int reg : call_effects::defs(instr, &calls)) {
+                    summary.clobbers.insert(reg);
+                }
+                switch (instr.op) {
+                    case ir::LOAD:
+                        access(summary.reads, constants::value(states[i], instr.reg[0]));
+                        break;
+                    case ir::STORE:
+                        summary.stores = true;
+                        access(summary.writes, constants::value(states[i], instr.reg[0]));
+                        break;
+                    case ir::SYSCALL:
+                        summary.syscalls = true;
+                        access(summary.reads, std::nullopt); // the buffers of write and open are read
+                        for (uint64_t addr : privileged) {
+                            if (syscalls::may_write(instr, states[i], addr)) {
+                                summary.writes.insert(addr);
+                            }
+                        }
+                        break;
+                    case ir::CALL:
+                        if (const call_effects::summary *callee = calls.find(instr)) {
+                            merge(summary, {{}, {}, callee->reads, callee->writes, callee->stores, callee->syscalls});
+                        } else {
+                            access(summary.reads, std::nullopt);
+                            access(summary.writes, std::nullopt);
+                            summary.stores = summary.syscalls = true;
+                        }
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+        return summary;
+    }
+};
+
+#endif //ANALYSIS_H
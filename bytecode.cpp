@@ -0,0 +1 @@
+#include "bytecode.h"
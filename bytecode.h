@@ -0,0 +1,248 @@
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Binary bytecode format
+//
+// Every instruction starts with a 16 bit little-endian word holding the opcode and up to three register operands:
+//
+//     bits  0-3  opcode
+//     bits  4-6  first register
+//     bits  7-9  second register
+//     bits 10-12 third register
+//     bits 13-15 reserved, always 0
+//
+// li is the only instruction with an immediate. It follows the word as an unsigned LEB128 varint, so small constants
+// and addresses take one to three bytes and a full 64 bit immediate takes ten.
+//
+// A program is the magic "JITB", a version byte and the instruction count as varint, followed by the instructions:
+//
+//     'J' 'I' 'T' 'B' <version> <count:varint> <instruction>*
+//
+// The text form is the one written to output.in, one instruction per line (e.g. "li 3 200").
+// Besides the ten instructions of the challenge we also encode cmpGT, which the transpiler emits for comparisons.
+
+class bytecode {
+public:
+    enum Opcode : uint8_t {
+        EXIT, ADD, SUB, MUL, LOAD, STORE, REQUEST, LI, JMP_EQ_Z, SYSCALL, CMP_GT,
+        NUM_OPCODES
+    };
+
+    static const uint8_t VERSION = 1;
+    static constexpr char MAGIC[4] = {'J', 'I', 'T', 'B'};
+    static const size_t HEADER_SIZE = sizeof(MAGIC) + 1;
+    static const size_t MAX_INSTRUCTION_SIZE = 2 + 10; // opcode word + longest varint
+
+    struct Instruction {
+        Opcode op = EXIT;
+        uint8_t reg[3] = {0, 0, 0};
+        uint64_t imm = 0;
+
+        bool operator==(const Instruction &other) const {
+            return op == other.op && reg[0] == other.reg[0] && reg[1] == other.reg[1] && reg[2] == other.reg[2] &&
+                   imm == other.imm;
+        }
+    };
+
+    static const char *mnemonic(Opcode op) {
+        static const char *names[NUM_OPCODES] = {
+            "exit", "add", "sub", "mul", "load", "store", "request", "li", "jmpEqZ", "syscall", "cmpGT"
+        };
+        return op < NUM_OPCODES ? names[op] : "invalid";
+    }
+
+    // number of register operands of an opcode (li has one register and the immediate)
+    static int register_count(Opcode op) {
+        switch (op) {
+            case EXIT: return 0;
+            case ADD: case SUB: case MUL: case CMP_GT: return 3;
+            case LOAD: case STORE: case REQUEST: case JMP_EQ_Z: return 2;
+            case LI: case SYSCALL: return 1;
+            default: return 0;
+        }
+    }
+
+    static bool parse_opcode(std::string_view name, Opcode &op) {
+        for (int i = 0; i < NUM_OPCODES; i++) {
+            if (name == mnemonic(static_cast<Opcode>(i))) {
+                op = static_cast<Opcode>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // ------------------------------------------------------------------------------------------------
+    // text form
+
+    // disassemble a single instruction to its text form (without new line)
+    static std::string to_string(const Instruction &instruction) {
+        std::string result = mnemonic(instruction.op);
+        for (int i = 0; i < register_count(instruction.op); i++) {
+            result += " " + std::to_string(instruction.reg[i]);
+        }
+        if (instruction.op == LI) {
+            result += " " + std::to_string(instruction.imm);
+        }
+        return result;
+    }
+
+    // split a line of the text form into whitespace separated words
+    static std::vector<std::string_view> split(std::string_view line) {
+        std::vector<std::string_view> words;
+        size_t pos = 0;
+        while (pos < line.size()) {
+            while (pos < line.size() && isspace(static_cast<unsigned char>(line[pos]))) {
+                pos++;
+            }
+            size_t start = pos;
+            while (pos < line.size() && !isspace(static_cast<unsigned char>(line[pos]))) {
+                pos++;
+            }
+            if (pos > start) {
+                words.push_back(line.substr(start, pos - start));
+            }
+        }
+        return words;
+    }
+
+    static bool parse_number(std::string_view word, uint64_t &value) {
+        if (word.empty()) {
+            return false;
+        }
+        value = 0;
+        for (char c : word) {
+            if (!isdigit(static_cast<unsigned char>(c))) {
+                return false;
+            }
+            uint64_t digit = c - '0';
+            if (value > (UINT64_MAX - digit) / 10) {
+                return false; // does not fit into 64 bits
+            }
+            value = value * 10 + digit;
+        }
+        return true;
+    }
+
+    // ------------------------------------------------------------------------------------------------
+    // binary form
+
+    // writes the varint to out and returns the number of bytes written (at most 10)
+    static size_t write_varint(uint64_t value, uint8_t *out) {
+        size_t size = 0;
+        while (value >= 0x80) {
+            out[size++] = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+        out[size++] = static_cast<uint8_t>(value);
+        return size;
+    }
+
+    // reads a varint from [pos, end), returns nullptr if it is truncated or longer than 64 bits
+    static const uint8_t *read_varint(const uint8_t *pos, const uint8_t *end, uint64_t &value) {
+        value = 0;
+        for (int shift = 0; pos < end && shift < 64; shift += 7) {
+            uint8_t byte = *pos++;
+            if (shift == 63 && (byte & 0x7e)) {
+                return nullptr; // the tenth byte only holds the highest bit
+            }
+            value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) {
+                return pos;
+            }
+        }
+        return nullptr;
+    }
+
+    // encodes one instruction to out (needs MAX_INSTRUCTION_SIZE bytes) and returns the number of bytes written
+    static size_t encode(const Instruction &instruction, uint8_t *out) {
+        uint16_t word = (instruction.op & 0xf) | ((instruction.reg[0] & 0x7) << 4) |
+                        ((instruction.reg[1] & 0x7) << 7) | ((instruction.reg[2] & 0x7) << 10);
+        out[0] = static_cast<uint8_t>(word);
+        out[1] = static_cast<uint8_t>(word >> 8);
+        if (instruction.op == LI) {
+            return 2 + write_varint(instruction.imm, out + 2);
+        }
+        return 2;
+    }
+
+    // writes the program header for count instructions to out (needs HEADER_SIZE + 10 bytes)
+    static size_t encode_header(uint64_t count, uint8_t *out) {
+        memcpy(out, MAGIC, sizeof(MAGIC));
+        out[sizeof(MAGIC)] = VERSION;
+        return HEADER_SIZE + write_varint(count, out + HEADER_SIZE);
+    }
+
+    // Zero-copy decoder: iterates over the instructions of an encoded program in place.
+    // The buffer must outlive the decoder, nothing is copied or allocated.
+    class decoder {
+        const uint8_t *pos = nullptr;
+        const uint8_t *end = nullptr;
+        uint64_t count = 0;
+        uint64_t remaining = 0;
+        bool valid = false;
+
+    public:
+        decoder(const uint8_t *data, size_t size) : pos(data), end(data + size) {
+            if (size < HEADER_SIZE || memcmp(data, MAGIC, sizeof(MAGIC)) != 0 || data[sizeof(MAGIC)] != VERSION) {
+                return;
+            }
+            pos = read_varint(data + HEADER_SIZE, end, count);
+            valid = pos != nullptr;
+            remaining = valid ? count : 0;
+        }
+
+        explicit decoder(const std::vector<uint8_t> &buffer) : decoder(buffer.data(), buffer.size()) {}
+
+        // false if the header is broken or a decoded instruction was malformed
+        bool ok() const { return valid; }
+
+        uint64_t size() const { return count; }
+
+        bool done() const { return remaining == 0 || !valid; }
+
+        /*
+         * Decodes the next instruction
+         * @param instruction - the decoded instruction
+         * @return bool - false at the end of the program or if the instruction is malformed (then ok() is false)
+         */
+        bool next(Instruction &instruction) {
+            if (done()) {
+                return false;
+            }
+            if (end - pos < 2) {
+                valid = false;
+                return false;
+            }
+            uint16_t word = pos[0] | (pos[1] << 8);
+            pos += 2;
+            if ((word & 0xf) >= NUM_OPCODES || (word >> 13) != 0) {
+                valid = false;
+                return false;
+            }
+            instruction.op = static_cast<Opcode>(word & 0xf);
+            instruction.reg[0] = (word >> 4) & 0x7;
+            instruction.reg[1] = (word >> 7) & 0x7;
+            instruction.reg[2] = (word >> 10) & 0x7;
+            instruction.imm = 0;
+            if (instruction.op == LI) {
+                pos = read_varint(pos, end, instruction.imm);
+                if (!pos) {
+                    valid = false;
+                    return false;
+                }
+            }
+            remaining--;
+            return true;
+        }
+    };
+};
+
+#endif //BYTECODE_H
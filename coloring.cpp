@@ -0,0 +1 @@
+#include "coloring.h"
@@ -0,0 +1,525 @@
+#ifndef COLORING_H
+#define COLORING_H
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include "ir.h"
+#include "costmodel.h"
+#include "regalloc.h"
+
+// Graph coloring register allocation with iterated register coalescing (George and Appel), used from -O2 on
+//
+// The virtual registers are the nodes of an interference graph, the machine registers 0 to 5 are precolored nodes.
+// Nodes with fewer than K = 6 neighbours are removed (simplify), copies whose ends do not interfere are merged when
+// that keeps the graph colorable (coalesce, Briggs and George tests), and when neither is possible a copy is given up
+// (freeze) or a node is pushed as a potential spill. Popping the nodes back assigns the colors.
+//
+// The ISA has no move, the transpiler copies with "li d 0; add d s d". Such a pair is one copy for the allocator:
+// the li does not interfere with anything, and the pair is removed when both ends end up in the same register. A copy
+// that survives and copies a constant becomes the li of the constant.
+//
+// The spill candidate is the node with the lowest spill cost per neighbour. A spilled value costs a store after every
+// definition and a load before every use (see cost_model), so a value used once is cheap to spill and a hot one is not.
+// A value kept in a register is pushed and popped around every call it lives across, spilling it saves that.
+// Constants and addresses loaded with li are rematerialized, they only cost a li per use and are spilled first.
+// Of the candidates that found no color only the first one is spilled, then the coloring starts over: the others may
+// well find a color once it is gone. The spill code itself is inserted by register_allocator::spill.
+
+class graph_coloring {
+public:
+    static const int K = register_allocator::ALLOCATABLE;
+    static const uint64_t UNSPILLABLE = uint64_t(1) << 40;
+
+    /*
+     * Spill cost of every virtual register: each definition is followed by a store to its slot and each use preceded
+     * by a load from it, both with the li and add of the slot address (see register_allocator::spill). A value with a
+     * single li as definition only costs that li again at every use. A value that lives across calls saves their
+     * pushes and pops in its slot. The temporaries of earlier spills cannot be spilled again.
+     */
+    static std::map<int, uint64_t> spill_costs(const ir::Function &function, const cost_model &costs,
+                                               const std::set<int> &temporaries) {
+        uint64_t address = costs.cycles[ir::LI] + costs.cycles[ir::ADD];
+        std::map<int, uint64_t> result;
+        for (const auto &block : function.blocks) {
+            for (const auto &instr : block.instrs) {
+                for (int reg : register_allocator::uses(instr)) {
+                    if (register_allocator::is_virtual(reg)) {
+                        result[reg] += address + costs.cycles[ir::LOAD];
+                    }
+                }
+                for (int reg : register_allocator::defs(instr)) {
+                    if (register_allocator::is_virtual(reg)) {
+                        result[reg] += address + costs.cycles[ir::STORE];
+                    }
+                }
+            }
+        }
+        for (const auto &[reg, li] : register_allocator::rematerializable(function)) {
+            uint64_t uses = 0;
+            for (const auto &block : function.blocks) {
+                for (const auto &instr : block.instrs) {
+                    auto read = register_allocator::uses(instr);
+                    uses += std::count(read.begin(), read.end(), reg);
+                }
+            }
+            result[reg] = uses * costs.cycles[ir::LI];
+        }
+        // a value in a register is pushed and popped around every call it lives across (see insert_call_saves), in
+        // its slot it is not
+        uint64_t save = costs.cycles[ir::STORE] + costs.cycles[ir::LOAD] + costs.cycles[ir::ADD] + costs.cycles[ir::SUB];
+        std::vector<size_t> calls;
+        size_t position = 0;
+        for (const auto &block : function.blocks) {
+            for (const auto &instr : block.instrs) {
+                if (instr.op == ir::CALL) {
+                    calls.push_back(position);
+                }
+                position += 2;
+            }
+        }
+        if (!calls.empty()) {
+            for (const auto &[reg, interval] : register_allocator::build_intervals(function)) {
+                auto found = result.find(reg);
+                if (found == result.end()) {
+                    continue;
+                }
+                uint64_t saves = save * std::count_if(calls.begin(), calls.end(), [&](size_t call) {
+                    return interval.contains(call) && interval.contains(call + 1);
+                });
+                found->second -= std::min(found->second, saves);
+            }
+        }
+        for (int reg : temporaries) {
+            result[reg] = UNSPILLABLE;
+        }
+        return result;
+    }
+
+    /*
+     * Colors the virtual registers of a function with the machine registers 0 to 5
+     * @param temporaries - virtual registers of spill code, they are spilled last
+     * @param spilled - receives the virtual register to spill: of those that did not get a color the one select_spill
+     *                  chose first
+     * @return bool - false if a register was spilled, the function is then unchanged
+     */
+    static bool allocate(ir::Function &function, const cost_model &costs, const std::set<int> &temporaries,
+                         std::set<int> &spilled) {
+        graph_coloring state(function, costs, temporaries);
+        state.run();
+        if (!state.spilled_nodes.empty()) {
+            // only the first choice of select_spill that found no color, spilling it can free the others
+            auto chosen = std::find_if(state.potential_spills.begin(), state.potential_spills.end(),
+                                       [&](int node) { return state.spilled_nodes.contains(node); });
+            spilled = {chosen != state.potential_spills.end() ? *chosen : *state.spilled_nodes.begin()};
+            return false;
+        }
+        std::map<int, int> assignment;
+        for (const auto &[node, color] : state.color) {
+            if (register_allocator::is_virtual(node)) {
+                assignment[node] = color;
+            }
+        }
+        auto all = register_allocator::copies(function);
+        auto remat = register_allocator::rematerializable(function);
+        register_allocator::rewrite(function, assignment);
+
+        // copies between the same register are gone, copies of constants become a li
+        register_allocator::lower_copies(function, all, remat, assignment);
+        return true;
+    }
+
+private:
+    using Edge = std::pair<int, int>;
+
+    const ir::Function &function;
+    std::map<int, uint64_t> cost;
+    std::vector<register_allocator::Copy> moves;
+
+    std::set<int> initial;
+    std::set<Edge> adjacent_set;
+    std::map<int, std::set<int>> adjacent_list;
+    std::map<int, int> degree;
+    std::map<int, std::set<size_t>> move_list;
+    std::map<int, int> alias;
+    std::map<int, int> color;
+
+    std::set<int> simplify_worklist, freeze_worklist, spill_worklist;
+    std::set<int> spilled_nodes, coalesced_nodes, colored_nodes;
+    std::vector<int> select_stack;
+    std::vector<int> potential_spills; // in the order select_spill chose them
+    std::set<int> on_stack;
+    std::set<size_t> coalesced_moves, constrained_moves, frozen_moves, worklist_moves, active_moves;
+
+    graph_coloring(const ir::Function &function, const cost_model &costs, const std::set<int> &temporaries)
+        : function(function), cost(spill_costs(function, costs, temporaries)), moves(register_allocator::copies(function)) {}
+
+    static bool precolored(int node) {
+        return node < K;
+    }
+
+    // the nodes of the graph: virtual registers and the allocatable machine registers
+    static bool is_node(int reg) {
+        return register_allocator::is_virtual(reg) || (reg >= 0 && reg < K);
+    }
+
+    void add_edge(int u, int v) {
+        if (u == v || adjacent_set.contains({u, v})) {
+            return;
+        }
+        adjacent_set.insert({u, v});
+        adjacent_set.insert({v, u});
+        if (!precolored(u)) {
+            adjacent_list[u].insert(v);
+            degree[u]++;
+        }
+        if (!precolored(v)) {
+            adjacent_list[v].insert(u);
+            degree[v]++;
+        }
+    }
+
+    void build() {
+        ir::CFG cfg(function);
+        auto reads = register_allocator::reaching_uses(function, cfg);
+        auto out = register_allocator::live_out(function, cfg, reads);
+        std::map<std::pair<size_t, size_t>, size_t> move_at; // (block, index of the add) -> copy
+        std::set<std::pair<size_t, size_t>> copy_li;
+        for (size_t m = 0; m < moves.size(); m++) {
+            move_at[{moves[m].block, moves[m].add}] = m;
+            copy_li.insert({moves[m].block, moves[m].li});
+        }
+
+        for (int r = 0; r < K; r++) {
+            degree[r] = INT_MAX / 2;
+        }
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            std::set<int> live;
+            for (int reg : out[b]) {
+                if (is_node(reg)) {
+                    live.insert(reg);
+                }
+            }
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = instrs.size(); i-- > 0;) {
+                std::vector<int> defs, uses;
+                for (int reg : register_allocator::defs(instrs[i])) {
+                    if (is_node(reg)) {
+                        defs.push_back(reg);
+                    }
+                }
+                for (int reg : reads[b][i]) {
+                    if (is_node(reg)) {
+                        uses.push_back(reg);
+                    }
+                }
+                for (int reg : defs) {
+                    if (register_allocator::is_virtual(reg)) {
+                        initial.insert(reg);
+                    }
+                }
+                for (int reg : uses) {
+                    if (register_allocator::is_virtual(reg)) {
+                        initial.insert(reg);
+                    }
+                }
+                if (copy_li.contains({b, i})) {
+                    // the li of a copy is part of the move below it
+                    live.erase(instrs[i].reg[0]);
+                    continue;
+                }
+                auto move = move_at.find({b, i});
+                if (move != move_at.end()) {
+                    const register_allocator::Copy &copy = moves[move->second];
+                    if (!is_node(copy.src) || !is_node(copy.dst)) {
+                        move_at.erase(move);
+                    } else {
+                        uses = {copy.src};
+                        live.erase(copy.src);
+                        move_list[copy.src].insert(move->second);
+                        move_list[copy.dst].insert(move->second);
+                        worklist_moves.insert(move->second);
+                    }
+                }
+                for (int d : defs) {
+                    live.insert(d);
+                }
+                for (int d : defs) {
+                    for (int l : live) {
+                        add_edge(l, d);
+                    }
+                }
+                for (int d : defs) {
+                    live.erase(d);
+                }
+                live.insert(uses.begin(), uses.end());
+            }
+        }
+    }
+
+    std::vector<int> adjacent(int node) const {
+        std::vector<int> result;
+        auto found = adjacent_list.find(node);
+        if (found == adjacent_list.end()) {
+            return result;
+        }
+        for (int m : found->second) {
+            if (!on_stack.contains(m) && !coalesced_nodes.contains(m)) {
+                result.push_back(m);
+            }
+        }
+        return result;
+    }
+
+    std::vector<size_t> node_moves(int node) const {
+        std::vector<size_t> result;
+        auto found = move_list.find(node);
+        if (found == move_list.end()) {
+            return result;
+        }
+        for (size_t m : found->second) {
+            if (active_moves.contains(m) || worklist_moves.contains(m)) {
+                result.push_back(m);
+            }
+        }
+        return result;
+    }
+
+    bool move_related(int node) const {
+        return !node_moves(node).empty();
+    }
+
+    void make_worklist() {
+        for (int node : initial) {
+            if (degree[node] >= K) {
+                spill_worklist.insert(node);
+            } else if (move_related(node)) {
+                freeze_worklist.insert(node);
+            } else {
+                simplify_worklist.insert(node);
+            }
+        }
+    }
+
+    void enable_moves(int node) {
+        for (size_t m : node_moves(node)) {
+            if (active_moves.erase(m)) {
+                worklist_moves.insert(m);
+            }
+        }
+    }
+
+    void decrement_degree(int node) {
+        if (precolored(node)) {
+            return;
+        }
+        int d = degree[node]--;
+        if (d == K) {
+            enable_moves(node);
+            for (int m : adjacent(node)) {
+                enable_moves(m);
+            }
+            spill_worklist.erase(node);
+            if (move_related(node)) {
+                freeze_worklist.insert(node);
+            } else {
+                simplify_worklist.insert(node);
+            }
+        }
+    }
+
+    void simplify() {
+        int node = *simplify_worklist.begin();
+        simplify_worklist.erase(simplify_worklist.begin());
+        select_stack.push_back(node);
+        on_stack.insert(node);
+        for (int m : adjacent(node)) {
+            decrement_degree(m);
+        }
+    }
+
+    int get_alias(int node) const {
+        while (coalesced_nodes.contains(node)) {
+            node = alias.at(node);
+        }
+        return node;
+    }
+
+    void add_worklist(int node) {
+        if (!precolored(node) && !move_related(node) && degree[node] < K) {
+            freeze_worklist.erase(node);
+            simplify_worklist.insert(node);
+        }
+    }
+
+    // George: merging v into the precolored u adds no significant neighbour to u
+    bool ok(int t, int r) const {
+        return degree.at(t) < K || precolored(t) || adjacent_set.contains({t, r});
+    }
+
+    // Briggs: the merged node has fewer than K significant neighbours
+    bool conservative(const std::set<int> &nodes) const {
+        int k = 0;
+        for (int node : nodes) {
+            if (degree.at(node) >= K) {
+                k++;
+            }
+        }
+        return k < K;
+    }
+
+    void combine(int u, int v) {
+        if (!freeze_worklist.erase(v)) {
+            spill_worklist.erase(v);
+        }
+        coalesced_nodes.insert(v);
+        alias[v] = u;
+        move_list[u].insert(move_list[v].begin(), move_list[v].end());
+        enable_moves(v);
+        for (int t : adjacent(v)) {
+            add_edge(t, u);
+            decrement_degree(t);
+        }
+        if (degree[u] >= K && freeze_worklist.erase(u)) {
+            spill_worklist.insert(u);
+        }
+    }
+
+    void coalesce() {
+        size_t m = *worklist_moves.begin();
+        worklist_moves.erase(worklist_moves.begin());
+        int x = get_alias(moves[m].dst);
+        int y = get_alias(moves[m].src);
+        int u = precolored(y) ? y : x;
+        int v = precolored(y) ? x : y;
+        if (u == v) {
+            coalesced_moves.insert(m);
+            add_worklist(u);
+        } else if (precolored(v) || adjacent_set.contains({u, v})) {
+            constrained_moves.insert(m);
+            add_worklist(u);
+            add_worklist(v);
+        } else {
+            bool george = precolored(u);
+            for (int t : adjacent(v)) {
+                george = george && ok(t, u);
+            }
+            std::set<int> merged;
+            if (!precolored(u)) {
+                for (int t : adjacent(u)) {
+                    merged.insert(t);
+                }
+                for (int t : adjacent(v)) {
+                    merged.insert(t);
+                }
+            }
+            if (george || (!precolored(u) && conservative(merged))) {
+                coalesced_moves.insert(m);
+                combine(u, v);
+                add_worklist(u);
+            } else {
+                active_moves.insert(m);
+            }
+        }
+    }
+
+    void freeze_moves(int u) {
+        for (size_t m : node_moves(u)) {
+            int x = moves[m].dst;
+            int y = moves[m].src;
+            int v = get_alias(y) == get_alias(u) ? get_alias(x) : get_alias(y);
+            active_moves.erase(m);
+            frozen_moves.insert(m);
+            if (!precolored(v) && node_moves(v).empty() && degree[v] < K) {
+                freeze_worklist.erase(v);
+                simplify_worklist.insert(v);
+            }
+        }
+    }
+
+    void freeze() {
+        int node = *freeze_worklist.begin();
+        freeze_worklist.erase(freeze_worklist.begin());
+        simplify_worklist.insert(node);
+        freeze_moves(node);
+    }
+
+    // the potential spill with the lowest cost per neighbour
+    void select_spill() {
+        int best = *spill_worklist.begin();
+        for (int node : spill_worklist) {
+            if (cost[node] * degree[best] < cost[best] * degree[node]) {
+                best = node;
+            }
+        }
+        spill_worklist.erase(best);
+        potential_spills.push_back(best);
+        simplify_worklist.insert(best);
+        freeze_moves(best);
+    }
+
+    void assign_colors() {
+        while (!select_stack.empty()) {
+            int node = select_stack.back();
+            select_stack.pop_back();
+            on_stack.erase(node);
+            std::set<int> ok_colors;
+            for (int c = 0; c < K; c++) {
+                ok_colors.insert(c);
+            }
+            for (int w : adjacent_list[node]) {
+                int a = get_alias(w);
+                if (precolored(a)) {
+                    ok_colors.erase(a);
+                } else if (colored_nodes.contains(a)) {
+                    ok_colors.erase(color[a]);
+                }
+            }
+            if (ok_colors.empty()) {
+                spilled_nodes.insert(node);
+                continue;
+            }
+            colored_nodes.insert(node);
+            // prefer the color of a copy partner, the copy then disappears as well
+            int chosen = *ok_colors.rbegin();
+            for (size_t m : move_list[node]) {
+                for (int partner : {get_alias(moves[m].dst), get_alias(moves[m].src)}) {
+                    int c = precolored(partner) ? partner : colored_nodes.contains(partner) ? color[partner] : -1;
+                    if (partner != node && ok_colors.contains(c)) {
+                        chosen = c;
+                    }
+                }
+            }
+            color[node] = chosen;
+        }
+        for (int node : coalesced_nodes) {
+            int a = get_alias(node);
+            color[node] = precolored(a) ? a : color[a];
+        }
+    }
+
+    void run() {
+        build();
+        make_worklist();
+        while (!simplify_worklist.empty() || !worklist_moves.empty() || !freeze_worklist.empty() ||
+               !spill_worklist.empty()) {
+            if (!simplify_worklist.empty()) {
+                simplify();
+            } else if (!worklist_moves.empty()) {
+                coalesce();
+            } else if (!freeze_worklist.empty()) {
+                freeze();
+            } else {
+                select_spill();
+            }
+        }
+        assign_colors();
+    }
+};
+
+#endif //COLORING_H
@@ -0,0 +1 @@
+#include "costmodel.h"
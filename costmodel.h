@@ -0,0 +1,191 @@
+#ifndef COSTMODEL_H
+#define COSTMODEL_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "ir.h"
+
+// Cycle costs of the target VM
+//
+// Built-in defaults are the ones of the challenge:
+//
+//     exit 0, add/sub/mul/cmpGT/li 1, jmpEqZ 5, store 5, load 10, syscall 20, request x: 20 + x^2/100
+//
+// Other VM variants are described by a config file with one "<key> <value>" pair per line, '#' starts a comment.
+// Keys are the instruction mnemonics plus
+//
+//     request_base      constant part of a request (20)
+//     request_divisor   the window term is x^2 / request_divisor (100)
+//     load_window       cycles requested for a load before windows are sized exactly (30)
+//     store_window      cycles requested for a store before windows are sized exactly (20)
+//
+// Every optimization and estimate asks the cost model instead of using its own constants.
+
+class cost_model {
+public:
+    std::array<uint64_t, ir::NUM_OPCODES> cycles{};
+    uint64_t request_base = 20;
+    uint64_t request_divisor = 100;
+    uint64_t load_window = 30;
+    uint64_t store_window = 20;
+
+    cost_model() {
+        cycles[ir::EXIT] = 0;
+        cycles[ir::ADD] = 1;
+        cycles[ir::SUB] = 1;
+        cycles[ir::MUL] = 1;
+        cycles[ir::CMP_GT] = 1;
+        cycles[ir::LI] = 1;
+        cycles[ir::LOAD] = 10;
+        cycles[ir::STORE] = 5;
+        cycles[ir::REQUEST] = 20;
+        cycles[ir::JMP_EQ_Z] = 5;
+        cycles[ir::SYSCALL] = 20;
+    }
+
+    // cycles of a request for a window of the given length
+    uint64_t request_cycles(uint64_t window) const {
+        return request_base + (request_divisor ? window * window / request_divisor : 0);
+    }
+
+    // Window a request needs so that a load/store starting elapsed cycles after the request completed also completes
+    // inside it. Sizing and verifying windows both use this.
+    uint64_t access_window(uint64_t elapsed, const ir::Instr &access) const {
+        return elapsed + cycles[access.op];
+    }
+
+    /*
+     * Cycles of a single instruction. call and ret are counted as their lowered instructions, the callee is not included.
+     * @param window - the requested window for request instructions
+     */
+    uint64_t instruction_cycles(const ir::Instr &instr, uint64_t window = 0) const {
+        switch (instr.op) {
+            case ir::REQUEST:
+                return request_cycles(window);
+            case ir::CALL:
+                return 3 * cycles[ir::LI] + cycles[ir::JMP_EQ_Z];
+            case ir::RET:
+                return cycles[ir::LI] + cycles[ir::JMP_EQ_Z];
+            default:
+                return cycles[instr.op];
+        }
+    }
+
+    /*
+     * Static estimate of a block: the sum of its instructions.
+     * The window of a request is the li of its cycle register in the same block, otherwise load_window.
+     */
+    uint64_t block_cycles(const ir::Block &block) const {
+        uint64_t total = 0;
+        for (size_t i = 0; i < block.instrs.size(); i++) {
+            const ir::Instr &instr = block.instrs[i];
+            uint64_t window = load_window;
+            if (instr.op == ir::REQUEST) {
+                for (size_t j = i; j-- > 0;) {
+                    if (ir::writes(block.instrs[j], instr.reg[1])) {
+                        if (block.instrs[j].op == ir::LI && block.instrs[j].symbol.empty()) {
+                            window = block.instrs[j].imm;
+                        }
+                        break;
+                    }
+                }
+            }
+            total += instruction_cycles(instr, window);
+        }
+        return total;
+    }
+
+    // Static estimate of a function: the sum of all its instructions (every block executed once).
+    uint64_t estimate(const ir::Function &function) const {
+        uint64_t total = 0;
+        for (const auto &block : function.blocks) {
+            total += block_cycles(block);
+        }
+        return total;
+    }
+
+    // Static estimate of the most expensive path through a function (jumps only go forward).
+    uint64_t longest_path(const ir::Function &function) const {
+        ir::CFG cfg(function);
+        size_t n = function.blocks.size();
+        std::vector<uint64_t> end(n, 0);
+        uint64_t longest = 0;
+        for (size_t b = 0; b < n; b++) {
+            uint64_t start = 0;
+            for (size_t p : cfg.predecessors[b]) {
+                if (p < b) {
+                    start = std::max(start, end[p]);
+                }
+            }
+            end[b] = start + block_cycles(function.blocks[b]);
+            longest = std::max(longest, end[b]);
+        }
+        return longest;
+    }
+
+    /*
+     * Reads a config file, keys that are not given keep their value
+     * @return bool - false if the file cannot be read or contains an unknown key
+     */
+    bool load(const char *file) {
+        std::ifstream in(file);
+        if (!in) {
+            fprintf(stderr, "Error: could not open cost model %s\n", file);
+            return false;
+        }
+        std::string line;
+        while (std::getline(in, line)) {
+            line = line.substr(0, line.find('#'));
+            auto words = bytecode::split(line);
+            if (words.empty()) {
+                continue;
+            }
+            uint64_t value;
+            if (words.size() != 2 || !bytecode::parse_number(words[1], value) || !set(words[0], value)) {
+                fprintf(stderr, "Error: invalid cost model line: %s\n", line.c_str());
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool set(std::string_view key, uint64_t value) {
+        bytecode::Opcode op;
+        if (key == "request" || key == "request_base") {
+            request_base = value;
+            cycles[ir::REQUEST] = value;
+        } else if (bytecode::parse_opcode(key, op)) {
+            cycles[op] = value;
+        } else if (key == "request_divisor") {
+            request_divisor = value;
+        } else if (key == "load_window") {
+            load_window = value;
+        } else if (key == "store_window") {
+            store_window = value;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    std::string to_string() const {
+        std::string result;
+        for (int op = 0; op < bytecode::NUM_OPCODES; op++) {
+            if (op != ir::REQUEST) {
+                result += std::string(ir::mnemonic(static_cast<ir::Opcode>(op))) + " " + std::to_string(cycles[op]) + "\n";
+            }
+        }
+        result += "request_base " + std::to_string(request_base) + "\n";
+        result += "request_divisor " + std::to_string(request_divisor) + "\n";
+        result += "load_window " + std::to_string(load_window) + "\n";
+        result += "store_window " + std::to_string(store_window) + "\n";
+        return result;
+    }
+};
+
+#endif //COSTMODEL_H
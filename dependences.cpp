@@ -0,0 +1 @@
+#include "dependences.h"
@@ -0,0 +1,226 @@
+#ifndef DEPENDENCES_H
+#define DEPENDENCES_H
+
+#include <algorithm>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "ir.h"
+#include "analysis.h"
+
+// Dependence graph of the instructions of a basic block
+//
+// An edge i -> j means that i has to stay before j. Arithmetic and loads only carry their true dependences, everything
+// with a side effect is kept in order by separate chains:
+//
+//     DATA     registers: read after write, write after read, write after write
+//     MEMORY   a load after the last store that may write its address, a store after the loads of its address,
+//              syscalls around the loads of memory they may write
+//     ORDER    every store after the previous store and on its side of every syscall (privileged writes stay in
+//              program order with the outside world, whatever the syscall reads)
+//     WINDOW   a request and the accesses and requests of its address
+//     SYSCALL  every syscall after the previous syscall
+//     CALL     calls and everything that touches memory, requests, syscalls and other calls
+//     CONTROL  the terminator after everything else
+//
+// Addresses that are not constant may be any address. Schedulers and code motion ask the graph instead of keeping the
+// source order.
+
+class dependence_graph {
+public:
+    enum Kind {
+        DATA,
+        MEMORY,
+        ORDER,
+        WINDOW,
+        SYSCALL,
+        CALL,
+        CONTROL
+    };
+
+    struct Edge {
+        size_t from;
+        Kind kind;
+    };
+
+    std::vector<std::vector<Edge>> preds; // the edges into every instruction
+
+    /*
+     * @param states - the known registers before every instruction of the block
+     */
+    dependence_graph(const ir::Block &block, const std::vector<constants::State> &states, const call_effects *calls) {
+        const auto &instrs = block.instrs;
+        size_t n = instrs.size();
+        preds.resize(n);
+        std::vector<std::optional<uint64_t>> addresses(n);
+        std::vector<bool> sink(n, true);
+
+        std::map<int, size_t> last_def;
+        std::map<int, std::vector<size_t>> readers; // since the last definition
+        std::optional<size_t> last_store, last_syscall, last_call;
+        std::vector<size_t> memory; // loads, stores, requests and syscalls since the last call
+
+        auto same = [&](size_t i, size_t j) { return !addresses[i] || !addresses[j] || addresses[i] == addresses[j]; };
+        // the syscall s may read (store = false) or write (store = true) the address of access a
+        auto touches = [&](size_t s, size_t a, bool store) {
+            if (!addresses[a]) {
+                return true;
+            }
+            return store ? syscalls::may_read(instrs[s], states[s], *addresses[a]) ||
+                           syscalls::may_write(instrs[s], states[s], *addresses[a])
+                         : syscalls::may_write(instrs[s], states[s], *addresses[a]);
+        };
+        auto add = [&](size_t i, size_t j, Kind kind) {
+            auto &edges = preds[j];
+            if (std::none_of(edges.begin(), edges.end(), [&](const Edge &e) { return e.from == i; })) {
+                edges.push_back({i, kind});
+                sink[i] = false;
+            }
+        };
+
+        for (size_t j = 0; j < n; j++) {
+            const ir::Instr &instr = instrs[j];
+            ir::Opcode op = instr.op;
+            if (op == ir::LOAD || op == ir::STORE || op == ir::REQUEST) {
+                addresses[j] = constants::value(states[j], instr.reg[0]);
+            }
+
+            if (ir::is_terminator(op)) {
+                for (size_t i = 0; i < j; i++) {
+                    if (sink[i]) {
+                        add(i, j, CONTROL);
+                    }
+                }
+                continue;
+            }
+
+            auto uses = call_effects::uses(instr, calls);
+            auto defs = call_effects::defs(instr, calls);
+            for (int r : uses) {
+                if (auto def = last_def.find(r); def != last_def.end()) {
+                    add(def->second, j, DATA);
+                }
+            }
+            for (int r : defs) {
+                if (auto def = last_def.find(r); def != last_def.end()) {
+                    add(def->second, j, DATA);
+                }
+                for (size_t reader : readers[r]) {
+                    if (reader != j) {
+                        add(reader, j, DATA);
+                    }
+                }
+            }
+
+            if (last_call && (op == ir::LOAD || op == ir::STORE || op == ir::REQUEST || op == ir::SYSCALL ||
+                              op == ir::CALL)) {
+                add(*last_call, j, CALL);
+            }
+            switch (op) {
+                case ir::LOAD:
+                case ir::STORE:
+                    for (size_t i : memory) {
+                        ir::Opcode other = instrs[i].op;
+                        if (other == ir::REQUEST && same(i, j)) {
+                            add(i, j, WINDOW);
+                        } else if ((other == ir::STORE || (op == ir::STORE && other == ir::LOAD)) && same(i, j)) {
+                            add(i, j, other == ir::STORE && op == ir::STORE ? ORDER : MEMORY);
+                        } else if (other == ir::SYSCALL && (op == ir::STORE || touches(i, j, false))) {
+                            add(i, j, op == ir::STORE ? ORDER : MEMORY);
+                        }
+                    }
+                    if (op == ir::STORE && last_store) {
+                        add(*last_store, j, ORDER);
+                    }
+                    break;
+                case ir::REQUEST:
+                    for (size_t i : memory) {
+                        ir::Opcode other = instrs[i].op;
+                        if (other != ir::SYSCALL && same(i, j)) {
+                            add(i, j, WINDOW);
+                        } else if (other == ir::SYSCALL && touches(i, j, true)) {
+                            add(i, j, WINDOW);
+                        }
+                    }
+                    break;
+                case ir::SYSCALL:
+                    for (size_t i : memory) {
+                        ir::Opcode other = instrs[i].op;
+                        if (other == ir::STORE) {
+                            add(i, j, ORDER);
+                        } else if (other == ir::LOAD && touches(j, i, false)) {
+                            add(i, j, MEMORY);
+                        } else if (other == ir::REQUEST && touches(j, i, true)) {
+                            add(i, j, WINDOW);
+                        }
+                    }
+                    if (last_syscall) {
+                        add(*last_syscall, j, SYSCALL);
+                    }
+                    break;
+                case ir::CALL:
+                    for (size_t i : memory) {
+                        add(i, j, CALL);
+                    }
+                    break;
+                default:
+                    break;
+            }
+
+            for (int r : uses) {
+                readers[r].push_back(j);
+            }
+            for (int r : defs) {
+                last_def[r] = j;
+                readers[r].clear();
+            }
+            if (op == ir::STORE) {
+                last_store = j;
+            } else if (op == ir::SYSCALL) {
+                last_syscall = j;
+            }
+            if (op == ir::CALL) {
+                last_call = j;
+                memory.clear();
+            } else if (op == ir::LOAD || op == ir::STORE || op == ir::REQUEST || op == ir::SYSCALL) {
+                memory.push_back(j);
+            }
+        }
+    }
+
+    // one graph for every block of a function
+    static std::vector<dependence_graph> build(const ir::Function &function, const constants &consts,
+                                               const call_effects *calls) {
+        std::vector<dependence_graph> graphs;
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            graphs.emplace_back(function.blocks[b], consts.states(function, b), calls);
+        }
+        return graphs;
+    }
+
+    // the instructions every instruction has to wait for
+    std::vector<std::vector<size_t>> predecessors() const {
+        std::vector<std::vector<size_t>> result(preds.size());
+        for (size_t j = 0; j < preds.size(); j++) {
+            for (const Edge &e : preds[j]) {
+                result[j].push_back(e.from);
+            }
+        }
+        return result;
+    }
+
+    std::string to_string() const {
+        static const char *names[] = {"data", "memory", "order", "window", "syscall", "call", "control"};
+        std::string result;
+        for (size_t j = 0; j < preds.size(); j++) {
+            for (const Edge &e : preds[j]) {
+                result += std::to_string(e.from) + " -> " + std::to_string(j) + " " + names[e.kind] + "\n";
+            }
+        }
+        return result;
+    }
+};
+
+#endif //DEPENDENCES_H
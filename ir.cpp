@@ -0,0 +1 @@
+#include "ir.h"
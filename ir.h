@@ -0,0 +1,582 @@
+#ifndef IR_H
+#define IR_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "bytecode.h"
+#include "object.h"
+
+// Mid-level IR
+//
+// The transpiler emits every function as a list of basic blocks of machine instructions. Jump targets and called
+// functions are still symbols, and calls and returns are the pseudo instructions call and ret. The optimization
+// passes work on this form, afterwards every function is lowered to an object (see object.h).
+//
+// Calling convention: the arguments are passed in registers 2 to 4, the result is returned in register 0 and call
+// puts the return address into register 5. call clobbers 0, 1 and 5 itself, the callee may change every register
+// except the stack and base pointer, so the caller saves what it still needs. ret jumps back to the address in
+// register 5, the entry function ends with exit instead.
+//
+// Text form (what --emit-ir writes and the ir tool reads):
+//
+//     privileged ggf 100        ; one line per privileged object: name and address
+//
+//     function bar 0            ; name and number of parameters
+//         li 3 100
+//         li 2 30
+//         request 3 2
+//         load 3 3
+//         li 4 ELSE_LABEL_0     ; li of a symbol, resolved when linking
+//         jmpEqZ 3 4
+//         call bar 0            ; call of bar with 0 arguments
+//     ELSE_LABEL_0:             ; a label starts a new basic block
+//         ret
+//     end
+//
+// Everything after ';' is a comment. A block also ends after every jmpEqZ, ret and exit.
+// Registers from NUMBER_REGISTERS on are virtual, the transpiler emits them and the register allocator (regalloc.h)
+// replaces them before the passes run.
+
+class ir {
+public:
+    // the first opcodes match bytecode::Opcode
+    enum Opcode {
+        EXIT, ADD, SUB, MUL, LOAD, STORE, REQUEST, LI, JMP_EQ_Z, SYSCALL, CMP_GT,
+        CALL, RET,
+        NUM_OPCODES
+    };
+
+    static constexpr int NONE = -1;
+    static constexpr int NUMBER_REGISTERS = 8;
+    static constexpr int STACK_POINTER = 6;
+    static constexpr int BASE_POINTER = 7;
+    static constexpr int RESULT = 0;
+    static constexpr int FIRST_ARGUMENT = 2;
+    static constexpr int MAX_ARGUMENTS = 3;
+    static constexpr int RETURN_ADDRESS = 5;
+
+    struct Instr {
+        Opcode op = EXIT;
+        int reg[3] = {NONE, NONE, NONE};
+        uint64_t imm = 0;     // li immediate, number of arguments for call
+        std::string symbol;   // li of a label or function, callee of call, resolved target of jmpEqZ (not printed)
+
+        Instr() = default;
+        Instr(Opcode op, int r0 = NONE, int r1 = NONE, int r2 = NONE) : op(op), reg{r0, r1, r2} {}
+
+        static Instr li(int reg, uint64_t imm) {
+            Instr instr(LI, reg);
+            instr.imm = imm;
+            return instr;
+        }
+
+        static Instr li(int reg, const std::string &symbol) {
+            Instr instr(LI, reg);
+            instr.symbol = symbol;
+            return instr;
+        }
+    };
+
+    struct Block {
+        std::string label; // empty for blocks only reached by falling through
+        std::vector<Instr> instrs;
+    };
+
+    struct Function {
+        std::string name;
+        int num_params = 0;
+        std::vector<Block> blocks;
+        uint64_t frame_size = 0; // stack words the function uses at most, set by the register allocator
+
+        size_t size() const {
+            size_t size = 0;
+            for (const auto &block : blocks) {
+                size += block.instrs.size();
+            }
+            return size;
+        }
+    };
+
+    struct Module {
+        std::vector<std::pair<std::string, uint16_t>> privileged; // name and address of the privileged objects
+        std::vector<Function> functions;
+
+        Function *find_function(const std::string &name) {
+            for (auto &function : functions) {
+                if (function.name == name) {
+                    return &function;
+                }
+            }
+            return nullptr;
+        }
+
+        const Function *find_function(const std::string &name) const {
+            for (const auto &function : functions) {
+                if (function.name == name) {
+                    return &function;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    static const char *mnemonic(Opcode op) {
+        switch (op) {
+            case CALL: return "call";
+            case RET: return "ret";
+            default: return bytecode::mnemonic(static_cast<bytecode::Opcode>(op));
+        }
+    }
+
+    static int register_count(Opcode op) {
+        return op < CALL ? bytecode::register_count(static_cast<bytecode::Opcode>(op)) : 0;
+    }
+
+    static bool is_terminator(Opcode op) {
+        return op == JMP_EQ_Z || op == EXIT || op == RET;
+    }
+
+    // ------------------------------------------------------------------------------------------------
+    // register effects
+
+    // registers read by an instruction, including the implicit syscall and call arguments
+    static std::vector<int> uses(const Instr &instr) {
+        switch (instr.op) {
+            case ADD: case SUB: case MUL: case CMP_GT: case STORE: case REQUEST: case JMP_EQ_Z:
+                return {instr.reg[0], instr.reg[1]};
+            case LOAD:
+                return {instr.reg[0]};
+            case SYSCALL:
+                return {instr.reg[0], 0, 1, 2};
+            case CALL: {
+                // the callee may read any register
+                std::vector<int> result;
+                for (int i = 0; i < NUMBER_REGISTERS; i++) {
+                    result.push_back(i);
+                }
+                return result;
+            }
+            case RET:
+                return {RESULT, RETURN_ADDRESS};
+            default:
+                return {};
+        }
+    }
+
+    // registers written by an instruction, including the syscall result and registers clobbered by calls
+    static std::vector<int> defs(const Instr &instr) {
+        switch (instr.op) {
+            case ADD: case SUB: case MUL: case CMP_GT:
+                return {instr.reg[2]};
+            case LOAD:
+                return {instr.reg[1]};
+            case LI:
+                return {instr.reg[0]};
+            case SYSCALL:
+                return {0};
+            case CALL: {
+                // everything except the stack and base pointer
+                std::vector<int> result;
+                for (int i = 0; i < NUMBER_REGISTERS; i++) {
+                    if (i != STACK_POINTER && i != BASE_POINTER) {
+                        result.push_back(i);
+                    }
+                }
+                return result;
+            }
+            default:
+                return {};
+        }
+    }
+
+    static bool reads(const Instr &instr, int reg) {
+        for (int r : uses(instr)) {
+            if (r == reg) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool writes(const Instr &instr, int reg) {
+        for (int r : defs(instr)) {
+            if (r == reg) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // instructions that must stay even if their result is unused
+    static bool has_side_effects(const Instr &instr) {
+        switch (instr.op) {
+            case ADD: case SUB: case MUL: case CMP_GT: case LI: case LOAD:
+                return false;
+            default:
+                return true;
+        }
+    }
+
+    // ------------------------------------------------------------------------------------------------
+    // control flow
+
+    // true if the jmpEqZ at index i of the block always jumps, i.e. its test register was set to 0 in the block
+    static bool is_unconditional_jump(const Block &block, size_t i) {
+        const Instr &jump = block.instrs[i];
+        for (size_t j = i; j-- > 0;) {
+            if (writes(block.instrs[j], jump.reg[0])) {
+                return block.instrs[j].op == LI && block.instrs[j].symbol.empty() && block.instrs[j].imm == 0;
+            }
+        }
+        return false;
+    }
+
+    // sets the symbol of every jmpEqZ whose target register was loaded with a symbol in the same block
+    static void resolve_jumps(Function &function) {
+        for (auto &block : function.blocks) {
+            for (size_t i = 0; i < block.instrs.size(); i++) {
+                Instr &jump = block.instrs[i];
+                if (jump.op != JMP_EQ_Z) {
+                    continue;
+                }
+                jump.symbol.clear();
+                for (size_t j = i; j-- > 0;) {
+                    if (writes(block.instrs[j], jump.reg[1])) {
+                        if (block.instrs[j].op == LI) {
+                            jump.symbol = block.instrs[j].symbol;
+                        }
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    // Control flow graph of a function over the block indices.
+    // A jmpEqZ to an unknown address (computed jump) leaves the function like ret.
+    struct CFG {
+        std::vector<std::vector<size_t>> successors;
+        std::vector<std::vector<size_t>> predecessors;
+
+        explicit CFG(const Function &function) {
+            size_t n = function.blocks.size();
+            successors.resize(n);
+            predecessors.resize(n);
+            std::unordered_map<std::string, size_t> labels;
+            for (size_t i = 0; i < n; i++) {
+                if (!function.blocks[i].label.empty()) {
+                    labels[function.blocks[i].label] = i;
+                }
+            }
+            for (size_t i = 0; i < n; i++) {
+                const Block &block = function.blocks[i];
+                bool falls_through = true;
+                if (!block.instrs.empty()) {
+                    const Instr &last = block.instrs.back();
+                    if (last.op == EXIT || last.op == RET) {
+                        falls_through = false;
+                    } else if (last.op == JMP_EQ_Z) {
+                        auto target = labels.find(last.symbol);
+                        if (target != labels.end()) {
+                            add_edge(i, target->second);
+                        }
+                        falls_through = !is_unconditional_jump(block, block.instrs.size() - 1);
+                    }
+                }
+                if (falls_through && i + 1 < n) {
+                    add_edge(i, i + 1);
+                }
+            }
+        }
+
+        void add_edge(size_t from, size_t to) {
+            for (size_t s : successors[from]) {
+                if (s == to) {
+                    return;
+                }
+            }
+            successors[from].push_back(to);
+            predecessors[to].push_back(from);
+        }
+    };
+
+    // ------------------------------------------------------------------------------------------------
+    // text form
+
+    static std::string to_string(const Instr &instr) {
+        std::string result = mnemonic(instr.op);
+        if (instr.op == CALL) {
+            return result + " " + instr.symbol + " " + std::to_string(instr.imm);
+        }
+        for (int i = 0; i < register_count(instr.op); i++) {
+            result += " " + std::to_string(instr.reg[i]);
+        }
+        if (instr.op == LI) {
+            result += " " + (instr.symbol.empty() ? std::to_string(instr.imm) : instr.symbol);
+        }
+        return result;
+    }
+
+    static std::string to_string(const Function &function) {
+        std::string result = "function " + function.name + " " + std::to_string(function.num_params) + "\n";
+        for (const auto &block : function.blocks) {
+            if (!block.label.empty()) {
+                result += block.label + ":\n";
+            }
+            for (const auto &instr : block.instrs) {
+                result += "    " + to_string(instr) + "\n";
+            }
+        }
+        return result + "end\n";
+    }
+
+    static std::string to_string(const Module &module) {
+        std::string result;
+        for (const auto &[name, address] : module.privileged) {
+            result += "privileged " + name + " " + std::to_string(address) + "\n";
+        }
+        for (const auto &function : module.functions) {
+            result += "\n" + to_string(function);
+        }
+        return result;
+    }
+
+    static bool parse_register(std::string_view word, int &reg) {
+        uint64_t value;
+        if (!bytecode::parse_number(word, value) || value > INT32_MAX) {
+            return false;
+        }
+        reg = static_cast<int>(value);
+        return true;
+    }
+
+    /*
+     * Parses one instruction of the text form
+     * @param words - the words of the line
+     * @param instr - the parsed instruction
+     * @return bool - false if the words are not a valid instruction
+     */
+    static bool parse(const std::vector<std::string_view> &words, Instr &instr) {
+        instr = Instr();
+        if (words.empty()) {
+            return false;
+        }
+        if (words[0] == "call") {
+            instr.op = CALL;
+            instr.symbol = words.size() > 1 ? std::string(words[1]) : "";
+            return words.size() == 3 && bytecode::parse_number(words[2], instr.imm);
+        }
+        if (words[0] == "ret") {
+            instr.op = RET;
+            return words.size() == 1;
+        }
+        bytecode::Opcode op;
+        if (!bytecode::parse_opcode(words[0], op)) {
+            return false;
+        }
+        instr.op = static_cast<Opcode>(op);
+        int registers = register_count(instr.op);
+        if (words.size() != static_cast<size_t>(1 + registers + (instr.op == LI ? 1 : 0))) {
+            return false;
+        }
+        for (int i = 0; i < registers; i++) {
+            if (!parse_register(words[1 + i], instr.reg[i])) {
+                return false;
+            }
+        }
+        if (instr.op == LI && !bytecode::parse_number(words[2], instr.imm)) {
+            if (!isalpha(static_cast<unsigned char>(words[2][0])) && words[2][0] != '_') {
+                return false;
+            }
+            instr.symbol = std::string(words[2]);
+        }
+        return true;
+    }
+
+    // strips the comment of a line
+    static std::string_view strip_comment(std::string_view line) {
+        size_t comment = line.find(';');
+        return comment == std::string_view::npos ? line : line.substr(0, comment);
+    }
+
+    // appends one line of a function body (labels and/or an instruction) to the function
+    static bool parse_line(std::string_view line, Function &function) {
+        line = strip_comment(line);
+        size_t colon;
+        while ((colon = line.find(':')) != std::string_view::npos) {
+            auto words = bytecode::split(line.substr(0, colon));
+            if (words.size() != 1) {
+                return false;
+            }
+            // a label always starts a new block, empty fall-through blocks are reused
+            if (function.blocks.empty() || !function.blocks.back().instrs.empty() ||
+                !function.blocks.back().label.empty()) {
+                function.blocks.emplace_back();
+            }
+            function.blocks.back().label = std::string(words[0]);
+            line = line.substr(colon + 1);
+        }
+        auto words = bytecode::split(line);
+        if (words.empty()) {
+            return true;
+        }
+        Instr instr;
+        if (!parse(words, instr)) {
+            return false;
+        }
+        if (function.blocks.empty() || (!function.blocks.back().instrs.empty() &&
+                                        is_terminator(function.blocks.back().instrs.back().op))) {
+            function.blocks.emplace_back();
+        }
+        function.blocks.back().instrs.push_back(instr);
+        return true;
+    }
+
+    static std::vector<std::string_view> lines(std::string_view text) {
+        std::vector<std::string_view> result;
+        size_t pos = 0;
+        while (pos < text.size()) {
+            size_t end = text.find('\n', pos);
+            if (end == std::string_view::npos) {
+                end = text.size();
+            }
+            result.push_back(text.substr(pos, end - pos));
+            pos = end + 1;
+        }
+        return result;
+    }
+
+    /*
+     * Parses the instructions of a single function (the text between "function" and "end")
+     * @return bool - false if a line is invalid, the line is printed
+     */
+    static bool parse_function(const std::string &name, int num_params, std::string_view text, Function &function) {
+        function = Function();
+        function.name = name;
+        function.num_params = num_params;
+        for (auto line : lines(text)) {
+            if (!parse_line(line, function)) {
+                fprintf(stderr, "Error: invalid IR line in %s: %s\n", name.c_str(), std::string(line).c_str());
+                return false;
+            }
+        }
+        resolve_jumps(function);
+        return true;
+    }
+
+    /*
+     * Parses a module in text form
+     * @return bool - false if a line is invalid, the line is printed
+     */
+    static bool parse_module(std::string_view text, Module &module) {
+        module = Module();
+        Function *function = nullptr;
+        for (auto line : lines(text)) {
+            auto words = bytecode::split(strip_comment(line));
+            if (!function && words.empty()) {
+                continue;
+            }
+            uint64_t value;
+            if (!function && words.size() == 3 && words[0] == "privileged" && bytecode::parse_number(words[2], value)) {
+                module.privileged.emplace_back(std::string(words[1]), static_cast<uint16_t>(value));
+            } else if (!function && words.size() == 3 && words[0] == "function" &&
+                       bytecode::parse_number(words[2], value)) {
+                module.functions.emplace_back();
+                function = &module.functions.back();
+                function->name = std::string(words[1]);
+                function->num_params = static_cast<int>(value);
+            } else if (function && words.size() == 1 && words[0] == "end") {
+                resolve_jumps(*function);
+                function = nullptr;
+            } else if (!function || !parse_line(line, *function)) {
+                fprintf(stderr, "Error: invalid IR line: %s\n", std::string(line).c_str());
+                return false;
+            }
+        }
+        if (function) {
+            fprintf(stderr, "Error: missing end of function %s\n", function->name.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // ------------------------------------------------------------------------------------------------
+    // lowering
+
+    /*
+     * Lowers a function to a relocatable object.
+     * call becomes "li 5 <back>; li 0 0; li 1 <callee>; jmpEqZ 0 1" where back is a local label right after the jump,
+     * ret becomes "li 1 0; jmpEqZ 1 5".
+     * @return bool - false if a register operand is not a machine register
+     */
+    static bool lower(const Function &function, object &obj) {
+        obj = object();
+        obj.name = function.name;
+        obj.symbols.push_back({function.name, 0, true});
+        std::unordered_set<std::string> labels;
+        for (const auto &block : function.blocks) {
+            if (!block.label.empty()) {
+                labels.insert(block.label);
+            }
+        }
+
+        auto emit = [&](const Instr &instr) {
+            bytecode::Instruction instruction;
+            instruction.op = static_cast<bytecode::Opcode>(instr.op);
+            for (int i = 0; i < register_count(instr.op); i++) {
+                if (instr.reg[i] < 0 || instr.reg[i] >= NUMBER_REGISTERS) {
+                    return false;
+                }
+                instruction.reg[i] = static_cast<uint8_t>(instr.reg[i]);
+            }
+            instruction.imm = instr.imm;
+            if (instr.op == LI && !instr.symbol.empty()) {
+                instruction.imm = 0;
+                obj.relocations.push_back({static_cast<uint32_t>(obj.code.size()),
+                                           labels.contains(instr.symbol) ? object::LOCAL : object::GLOBAL,
+                                           instr.symbol});
+            }
+            obj.code.push_back(instruction);
+            return true;
+        };
+
+        int calls = 0;
+        for (const auto &block : function.blocks) {
+            if (!block.label.empty()) {
+                obj.symbols.push_back({block.label, static_cast<uint32_t>(obj.code.size()), false});
+            }
+            for (const auto &instr : block.instrs) {
+                bool ok;
+                switch (instr.op) {
+                    case CALL: {
+                        std::string back = "RETURN_" + std::to_string(calls++);
+                        labels.insert(back);
+                        ok = emit(Instr::li(RETURN_ADDRESS, back)) && emit(Instr::li(0, 0)) &&
+                             emit(Instr::li(1, instr.symbol)) && emit(Instr(JMP_EQ_Z, 0, 1));
+                        obj.symbols.push_back({back, static_cast<uint32_t>(obj.code.size()), false});
+                        break;
+                    }
+                    case RET:
+                        ok = emit(Instr::li(1, 0)) && emit(Instr(JMP_EQ_Z, 1, RETURN_ADDRESS));
+                        break;
+                    default:
+                        ok = emit(instr);
+                        break;
+                }
+                if (!ok) {
+                    fprintf(stderr, "Error: invalid register in %s: %s\n", function.name.c_str(),
+                            to_string(instr).c_str());
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+};
+
+#endif //IR_H
@@ -0,0 +1,96 @@
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include "ir.h"
+#include "pass_manager.h"
+#include "verifier.h"
+
+// Runs a list of passes on an IR file (e.g. one written by hackatum2024 --emit-ir) and prints the result.
+//
+// usage: jitopt [-p pass1,pass2,...] [--cost-model <file>] [--cycles] [--verify] [--print-after-all] [--time-passes]
+//               [--list] <file.ir>
+
+std::vector<std::string> split_passes(const std::string &list) {
+    std::vector<std::string> names;
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos) {
+            end = list.size();
+        }
+        if (end > pos) {
+            names.push_back(list.substr(pos, end - pos));
+        }
+        pos = end + 1;
+    }
+    return names;
+}
+
+int main(int argc, char **argv) {
+    pass_manager manager;
+    std::vector<std::string> pipeline = pass_manager::default_pipeline();
+    const char *in_file = nullptr;
+    bool print_cycles = false;
+    bool verify = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            pipeline = split_passes(argv[++i]);
+        } else if (strcmp(argv[i], "--cost-model") == 0 && i + 1 < argc) {
+            if (!manager.costs.load(argv[++i])) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--cycles") == 0) {
+            print_cycles = true;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[i], "--print-after-all") == 0) {
+            manager.print_after_all = true;
+        } else if (strcmp(argv[i], "--time-passes") == 0) {
+            manager.time_passes = true;
+        } else if (strcmp(argv[i], "--list") == 0) {
+            for (const auto &pass : pass_manager::registry()) {
+                printf("%-24s %s\n", pass.name.c_str(), pass.description.c_str());
+            }
+            return 0;
+        } else {
+            in_file = argv[i];
+        }
+    }
+    if (!in_file) {
+        printf("usage: jitopt [-p pass1,pass2,...] [--cost-model <file>] [--cycles] [--verify] [--print-after-all] "
+               "[--time-passes] [--list] <file.ir>\n");
+        return 1;
+    }
+
+    std::ifstream in(in_file);
+    if (!in) {
+        fprintf(stderr, "Error: could not open file\n");
+        return 1;
+    }
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+    ir::Module module;
+    if (!ir::parse_module(text, module)) {
+        return 1;
+    }
+    if (!manager.run(module, pipeline)) {
+        return 1;
+    }
+    if (verify) {
+        // the windows after the passes: violations and slack
+        auto report = window_verifier::verify(module, manager.costs);
+        printf("%s", report.to_string().c_str());
+        return report.ok() ? 0 : 1;
+    }
+    if (print_cycles) {
+        for (const auto &function : module.functions) {
+            printf("%s: %zu instructions, estimated %llu cycles\n", function.name.c_str(), function.size(),
+                   static_cast<unsigned long long>(manager.costs.estimate(function)));
+        }
+    } else if (!manager.print_after_all) {
+        std::cout << ir::to_string(module);
+    }
+    return 0;
+}
@@ -224,7 +224,7 @@ public:
         std::queue<Token> tokens;
         FILE *f = fopen(file, "r");
         if (!f) {
-            printf("Error: could not open file\n");
+            fprintf(stderr, "Error: could not open file\n");
             return tokens;
         }
 
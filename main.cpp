@@ -1,7 +1,33 @@
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cstring>
 #include "lexer.h"
 #include "parser.h"
 #include "transpiler.h"
+#include "bytecode.h"
+#include "writer.h"
+
+// print the text form of an encoded program
+int disassemble(const char* file) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in) {
+        fprintf(stderr, "Error: could not open file\n");
+        return 1;
+    }
+    std::vector<uint8_t> buffer((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    output_writer out(STDOUT_FILENO);
+    bytecode::decoder dec(buffer);
+    bytecode::Instruction instruction;
+    while (dec.next(instruction)) {
+        out.write_text(instruction);
+    }
+    if (!out.close() || !dec.ok()) {
+        fprintf(stderr, "Error: malformed bytecode\n");
+        return 1;
+    }
+    return 0;
+}
 
 // TIP To <b>Run</b> code, press <shortcut actionId="Run"/> or
 // click the <icon src="AllIcons.Actions.Execute"/> icon in the gutter.
@@ -10,16 +36,52 @@ int main(int argc, char** argv) {
     parser parse;
     transpiler tran;
 
-    const char* IN_FILE = argv[1] ? argv[1] : "../test.txt";
-    const char* OUT_FILE = "output.in";
+    // usage: hackatum2024 [--binary | --emit-ir] [-O0 | -O1 | -O2 | -O3] [--cost-model <file>] [-o <file> | -o -] [input]
+    //        hackatum2024 --disassemble <bytecode>
+    const char* IN_FILE = "../test.txt";
+    const char* OUT_FILE = nullptr;
+    auto format = transpiler::TEXT;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--disassemble") == 0 && i + 1 < argc) {
+            return disassemble(argv[i + 1]);
+        } else if (strcmp(argv[i], "--binary") == 0) {
+            format = transpiler::BINARY;
+        } else if (strcmp(argv[i], "--cost-model") == 0 && i + 1 < argc) {
+            cost_model costs;
+            if (!costs.load(argv[++i])) {
+                return 1;
+            }
+            tran.set_cost_model(costs);
+        } else if (strncmp(argv[i], "-O", 2) == 0 && argv[i][2] >= '0' && argv[i][2] <= '9' && !argv[i][3]) {
+            tran.set_optimization_level(argv[i][2] - '0');
+        } else if (strcmp(argv[i], "--emit-ir") == 0) {
+            format = transpiler::IR;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            OUT_FILE = argv[++i];
+        } else {
+            IN_FILE = argv[i];
+        }
+    }
+    if (!OUT_FILE) {
+        OUT_FILE = format == transpiler::BINARY ? "output.bin" : format == transpiler::IR ? "output.ir" : "output.in";
+    }
+
+    output_writer out;
+    if (!out.open(OUT_FILE)) {
+        return 1;
+    }
+    // the debug dumps must not end up in the program when writing to stdout
+    std::ostream& log = out.is_stdout() ? std::cerr : std::cout;
 
     auto token_queue = lex.lexer_fct(IN_FILE);
-    std::cout << lex.to_string(token_queue) << std::endl;
+    log << lex.to_string(token_queue) << std::endl;
 
     auto ast = parse.generateAst(token_queue);
-    std::cout << parse.to_string(ast) << std::endl;
+    log << parse.to_string(ast) << std::endl;
 
-    tran.transpile(OUT_FILE, ast);
+    if (!tran.transpile(out, ast, format) || !out.close()) {
+        return 1;
+    }
 
     return 0;
 }
@@ -27,4 +89,4 @@ int main(int argc, char** argv) {
 // TIP See CLion help at <a
 // href="https://www.jetbrains.com/help/clion/">jetbrains.com/help/clion/</a>.
 //  Also, you can try interactive lessons for CLion by selecting
-//  'Help | Learn IDE Features' from the main menu.
\ No newline at end of file
+//  'Help | Learn IDE Features' from the main menu.
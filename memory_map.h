@@ -0,0 +1,205 @@
+#ifndef MEMORY_MAP_H
+#define MEMORY_MAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ir.h"
+
+// Placement of the memory the compiler uses itself
+//
+// Addresses below 2^16 are usable. The privileged objects of the program have fixed addresses, the stack (and
+// anything else the compiler stores) must stay clear of them or it silently overwrites them. The planner collects the
+// privileged addresses, bounds the stack with the call graph and the frame size of every function (spill slots and
+// the registers pushed around calls, see register_allocator) and picks a free range for it. Recursive programs get the
+// largest free range, programs that never touch the stack get no stack and no stack setup at all.
+//
+// The stack of a recursive program cannot be bounded at compile time. Every function whose stack use is not bounded
+// (it is recursive or calls a recursive function) checks the stack pointer at its entry and exits the program when
+// its frame and the deepest bounded calls it makes would not fit below the end of the range (insert_stack_check):
+//
+//     li 0 <limit>; cmpGT 6 0 0; li 1 STACK_CHECKED; jmpEqZ 0 1; exit; STACK_CHECKED:
+
+class memory_map {
+public:
+    static const uint64_t ADDRESS_LIMIT = 1 << 16;
+    static const uint64_t DEFAULT_STACK = 9216; // preferred start, the fixed stack of earlier versions
+
+    struct Range {
+        uint64_t start;
+        uint64_t size;
+    };
+
+    std::set<uint64_t> privileged;
+    std::optional<uint64_t> words; // stack words the program needs at most, nullopt if it is recursive
+    std::optional<Range> stack;    // nullopt if no stack is needed
+
+    /*
+     * The stack words of the deepest chain of nested calls starting at a function: the frames of the functions on it
+     * @return nullopt if a recursive call is reachable
+     */
+    static std::optional<uint64_t> stack_words(const ir::Module &module, const std::string &name) {
+        std::map<std::string, std::optional<uint64_t>> finished; // stack words of the finished functions
+        std::set<std::string> active;                           // functions on the current chain
+        auto visit = [&](auto &self, const std::string &function) -> std::optional<uint64_t> {
+            if (active.contains(function)) {
+                return std::nullopt;
+            }
+            if (auto found = finished.find(function); found != finished.end()) {
+                return found->second;
+            }
+            const ir::Function *f = module.find_function(function);
+            if (!f) {
+                return 0; // not part of the program, its stack use is not ours to plan
+            }
+            active.insert(function);
+            std::optional<uint64_t> deepest = 0; // of the callees
+            for (const auto &block : f->blocks) {
+                for (const auto &instr : block.instrs) {
+                    if (instr.op != ir::CALL || !deepest) {
+                        continue;
+                    }
+                    auto callee = self(self, instr.symbol);
+                    deepest = callee ? std::optional<uint64_t>(std::max(*deepest, *callee)) : std::nullopt;
+                }
+            }
+            active.erase(function);
+            std::optional<uint64_t> words = deepest ? std::optional<uint64_t>(f->frame_size + *deepest) : std::nullopt;
+            finished[function] = words;
+            return words;
+        };
+        return visit(visit, name);
+    }
+
+    // the ranges below ADDRESS_LIMIT that hold no privileged object, in increasing order
+    static std::vector<Range> free_ranges(const std::set<uint64_t> &privileged) {
+        std::vector<Range> ranges;
+        uint64_t start = 0;
+        for (uint64_t addr : privileged) {
+            if (addr >= ADDRESS_LIMIT) {
+                break;
+            }
+            if (addr > start) {
+                ranges.push_back({start, addr - start});
+            }
+            start = addr + 1;
+        }
+        if (start < ADDRESS_LIMIT) {
+            ranges.push_back({start, ADDRESS_LIMIT - start});
+        }
+        return ranges;
+    }
+
+    /*
+     * Plans the memory of a program that starts at entry
+     * @return bool - false if the stack does not fit anywhere
+     */
+    bool plan(const ir::Module &module, const std::string &entry = "main") {
+        privileged.clear();
+        for (const auto &[name, addr] : module.privileged) {
+            privileged.insert(addr);
+        }
+        words = stack_words(module, entry);
+        stack.reset();
+        if (words == 0) {
+            return true;
+        }
+
+        auto ranges = free_ranges(privileged);
+        if (!words) {
+            auto largest = std::max_element(ranges.begin(), ranges.end(),
+                                            [](const Range &a, const Range &b) { return a.size < b.size; });
+            if (largest != ranges.end()) {
+                stack = *largest;
+            }
+        } else {
+            uint64_t size = *words;
+            for (const auto &range : ranges) {
+                if (range.start <= DEFAULT_STACK && DEFAULT_STACK + size <= range.start + range.size) {
+                    stack = Range{DEFAULT_STACK, size};
+                    break;
+                }
+            }
+            for (size_t i = 0; i < ranges.size() && !stack; i++) {
+                if (ranges[i].size >= size) {
+                    stack = Range{ranges[i].start, size};
+                }
+            }
+        }
+        if (!stack) {
+            fprintf(stderr, "Error: no room for the stack between the privileged objects\n");
+            return false;
+        }
+        return true;
+    }
+
+    /*
+     * The largest stack pointer at the entry of every function whose stack use is not bounded that still leaves room
+     * for its frame and the deepest chain of bounded calls it makes. The unbounded functions it calls check for
+     * themselves. Only meaningful after plan, the frame sizes must be set.
+     * @return function name -> limit, empty if the stack is bounded
+     */
+    std::map<std::string, uint64_t> stack_limits(const ir::Module &module) const {
+        std::map<std::string, uint64_t> limits;
+        if (words || !stack) {
+            return limits;
+        }
+        uint64_t end = stack->start + stack->size;
+        for (const auto &function : module.functions) {
+            if (stack_words(module, function.name)) {
+                continue;
+            }
+            uint64_t deepest = 0;
+            for (const auto &block : function.blocks) {
+                for (const auto &instr : block.instrs) {
+                    if (instr.op != ir::CALL) {
+                        continue;
+                    }
+                    if (auto callee = stack_words(module, instr.symbol)) {
+                        deepest = std::max(deepest, *callee);
+                    }
+                }
+            }
+            uint64_t needed = function.frame_size + deepest;
+            limits[function.name] = needed < end ? end - needed : 0;
+        }
+        return limits;
+    }
+
+    /*
+     * Exits the program at the entry of a function if the stack pointer is above limit. Registers 0 and 1 hold
+     * nothing at the entry of a function (the arguments are in 2 to 4 and the return address in 5).
+     */
+    static void insert_stack_check(ir::Function &function, uint64_t limit) {
+        if (function.blocks.empty()) {
+            function.blocks.emplace_back();
+        }
+        if (function.blocks[0].label.empty()) {
+            function.blocks[0].label = "STACK_CHECKED";
+        }
+        const std::string label = function.blocks[0].label;
+        ir::Instr jump(ir::JMP_EQ_Z, 0, 1);
+        jump.symbol = label;
+        ir::Block check;
+        check.instrs = {ir::Instr::li(0, limit), ir::Instr(ir::CMP_GT, ir::STACK_POINTER, 0, 0),
+                        ir::Instr::li(1, label), jump};
+        ir::Block overflow;
+        overflow.instrs = {ir::Instr(ir::EXIT)};
+        function.blocks.insert(function.blocks.begin(), {check, overflow});
+    }
+
+    std::string to_string() const {
+        if (!stack) {
+            return "no stack\n";
+        }
+        return "stack " + std::to_string(stack->start) + " - " + std::to_string(stack->start + stack->size) +
+               (words ? "\n" : ", recursive\n");
+    }
+};
+
+#endif //MEMORY_MAP_H
@@ -0,0 +1 @@
+#include "object.h"
@@ -0,0 +1,134 @@
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "bytecode.h"
+
+// Relocatable object format
+//
+// Every function is compiled to its own object. An object holds the code of the function, the symbols it defines
+// (the function itself and its local jump labels) and relocations for every li that loads the address of a symbol:
+//
+//     li 1 bar          -> GLOBAL relocation, resolved against the symbols of all objects (calls)
+//     li 2 ELSE_LABEL_3 -> LOCAL relocation, resolved against the symbols of this object (branches)
+//
+// The linker lays the objects out one after another, entry function first, and patches the immediates of the
+// relocated li instructions with the final addresses. Objects do not depend on their position, the lowering
+// (see ir::lower) builds them directly from the IR of each function.
+
+class object {
+public:
+    enum RelocationKind : uint8_t {
+        LOCAL, // branch target inside the object
+        GLOBAL // another function (call)
+    };
+
+    struct Symbol {
+        std::string name;
+        uint32_t offset; // instruction index inside the object
+        bool global;
+    };
+
+    struct Relocation {
+        uint32_t offset; // index of the li instruction whose immediate is replaced by the address
+        RelocationKind kind;
+        std::string symbol;
+    };
+
+    std::string name;
+    std::vector<bytecode::Instruction> code;
+    std::vector<Symbol> symbols;
+    std::vector<Relocation> relocations;
+
+    const Symbol *find_symbol(const std::string &symbol) const {
+        for (const auto &s : symbols) {
+            if (s.name == symbol) {
+                return &s;
+            }
+        }
+        return nullptr;
+    }
+};
+
+class linker {
+public:
+    // address of the first instruction, jmpEqZ targets are 1-based line numbers of the output
+    static const uint64_t BASE_ADDRESS = 1;
+
+    /*
+     * Lays out the objects and resolves all relocations.
+     * The entry object is placed first so execution starts there, the others keep their order.
+     * @param objects - the objects to link
+     * @param entry - name of the entry function
+     * @param program - receives the linked program
+     * @return bool - false on undefined or duplicate symbols, or a symbol or relocation outside the code of its object
+     */
+    static bool link(const std::vector<object> &objects, const std::string &entry,
+                     std::vector<bytecode::Instruction> &program) {
+        std::vector<const object *> layout;
+        for (const auto &obj : objects) {
+            if (obj.name == entry) {
+                layout.push_back(&obj);
+            }
+        }
+        for (const auto &obj : objects) {
+            if (obj.name != entry) {
+                layout.push_back(&obj);
+            }
+        }
+
+        // assign the base address of every object and collect the global symbols
+        std::vector<uint64_t> base(layout.size());
+        std::unordered_map<std::string, uint64_t> globals;
+        uint64_t address = BASE_ADDRESS;
+        for (size_t i = 0; i < layout.size(); i++) {
+            base[i] = address;
+            for (const auto &symbol : layout[i]->symbols) {
+                // a label may stand at the very end of the code
+                if (symbol.offset > layout[i]->code.size()) {
+                    fprintf(stderr, "Error: symbol %s outside of %s\n", symbol.name.c_str(), layout[i]->name.c_str());
+                    return false;
+                }
+                if (symbol.global && !globals.emplace(symbol.name, address + symbol.offset).second) {
+                    fprintf(stderr, "Error: duplicate symbol %s\n", symbol.name.c_str());
+                    return false;
+                }
+            }
+            address += layout[i]->code.size();
+        }
+
+        program.clear();
+        program.reserve(address - BASE_ADDRESS);
+        for (size_t i = 0; i < layout.size(); i++) {
+            const object &obj = *layout[i];
+            size_t start = program.size();
+            program.insert(program.end(), obj.code.begin(), obj.code.end());
+            for (const auto &relocation : obj.relocations) {
+                if (relocation.offset >= obj.code.size() || obj.code[relocation.offset].op != bytecode::LI) {
+                    fprintf(stderr, "Error: relocation of %s in %s is not at a li\n", relocation.symbol.c_str(),
+                            obj.name.c_str());
+                    return false;
+                }
+                uint64_t target;
+                const object::Symbol *local = relocation.kind == object::LOCAL ? obj.find_symbol(relocation.symbol)
+                                                                               : nullptr;
+                if (local) {
+                    target = base[i] + local->offset;
+                } else if (globals.contains(relocation.symbol)) {
+                    target = globals[relocation.symbol];
+                } else {
+                    fprintf(stderr, "Error: undefined symbol %s in %s\n", relocation.symbol.c_str(), obj.name.c_str());
+                    return false;
+                }
+                program[start + relocation.offset].imm = target;
+            }
+        }
+        return true;
+    }
+};
+
+#endif //OBJECT_H
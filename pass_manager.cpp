@@ -0,0 +1 @@
+#include "pass_manager.h"
@@ -0,0 +1,112 @@
+#ifndef PASS_MANAGER_H
+#define PASS_MANAGER_H
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "ir.h"
+#include "costmodel.h"
+#include "passes.h"
+#include "requests.h"
+#include "scheduler.h"
+
+// Registry of all passes by name, so a pass list can be given on the command line of the ir tool
+// ("-p dead-li,size-requests") while the compiler runs pass_manager::default_pipeline().
+
+class pass_manager {
+public:
+    using Pass = std::function<bool(ir::Function &, const pass_context &)>;
+
+    struct PassInfo {
+        std::string name;
+        std::string description;
+        Pass run;
+    };
+
+    static const std::vector<PassInfo> &registry() {
+        static const std::vector<PassInfo> all = {
+            {"dead-li", "remove li instructions overwritten before use", passes::dead_li},
+            {"cache-privileged", "reuse privileged values that are still in a register instead of loading them again",
+             request_passes::cache_privileged},
+            {"cover-read-modify-write",
+             "let the request of the load in x = x op y also cover the store when one longer window is cheaper",
+             request_passes::cover_read_modify_write},
+            {"hoist-requests", "replace the requests of an address in all paths after a branch by one before it",
+             request_passes::hoist_requests},
+            {"plan-requests", "let one request cover the accesses of several when that saves cycles",
+             request_passes::plan_requests},
+            {"schedule-windows", "move independent instructions out of request windows",
+             scheduler::schedule_windows},
+            {"size-requests", "shrink every request window to the cycles its accesses need",
+             request_passes::size_requests},
+            {"pin-addresses", "keep hot privileged addresses in unused registers when that saves cycles",
+             request_passes::pin_addresses},
+            {"reuse-constants", "read constants (mostly addresses) from registers that already hold them",
+             passes::reuse_constants},
+        };
+        return all;
+    }
+
+    static const PassInfo *find(const std::string &name) {
+        for (const auto &pass : registry()) {
+            if (pass.name == name) {
+                return &pass;
+            }
+        }
+        return nullptr;
+    }
+
+    // the passes the compiler runs, in order
+    static std::vector<std::string> default_pipeline() {
+        // windows are sized again at the end, reuse-constants removes instructions from them
+        return {"dead-li",         "cache-privileged", "dead-li",          "cover-read-modify-write",
+                "hoist-requests",  "plan-requests",    "schedule-windows", "size-requests",
+                "pin-addresses",   "reuse-constants",  "size-requests"};
+    }
+
+    cost_model costs;
+    bool print_after_all = false; // dump the module after every pass
+    bool time_passes = false;     // print the time spent in every pass
+
+    /*
+     * Runs the passes in the given order on every function of the module
+     * @return bool - false if a pass name is unknown
+     */
+    bool run(ir::Module &module, const std::vector<std::string> &names) const {
+        for (const auto &name : names) {
+            const PassInfo *pass = find(name);
+            if (!pass) {
+                fprintf(stderr, "Error: unknown pass %s\n", name.c_str());
+                return false;
+            }
+            auto start = std::chrono::steady_clock::now();
+            // the summaries are only computed again after the pass changed a function, the callers of that
+            // function may see different clobbers
+            call_effects calls = summaries::compute(module);
+            pass_context context{module, costs, &calls};
+            for (auto &function : module.functions) {
+                if (pass->run(function, context)) {
+                    calls = summaries::compute(module);
+                }
+            }
+            auto end = std::chrono::steady_clock::now();
+            if (time_passes) {
+                fprintf(stderr, "%-24s %10.3f ms\n", name.c_str(),
+                        std::chrono::duration<double, std::milli>(end - start).count());
+            }
+            if (print_after_all) {
+                printf("; after %s\n", name.c_str());
+                for (const auto &function : module.functions) {
+                    printf("; %s: %zu instructions, estimated %llu cycles\n", function.name.c_str(), function.size(),
+                           static_cast<unsigned long long>(costs.estimate(function)));
+                }
+                printf("%s\n", ir::to_string(module).c_str());
+            }
+        }
+        return true;
+    }
+};
+
+#endif //PASS_MANAGER_H
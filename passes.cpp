@@ -0,0 +1 @@
+#include "passes.h"
@@ -0,0 +1,218 @@
+#ifndef PASSES_H
+#define PASSES_H
+
+#include <string>
+#include <vector>
+
+#include "ir.h"
+#include "costmodel.h"
+#include "analysis.h"
+
+// Optimization passes on the IR (see ir.h)
+//
+// Every pass is a function (ir::Function &, const pass_context &) returning whether it changed the function.
+// Passes get the module, the cost model of the target (cycle decisions must be made with it) and the summaries of the
+// functions of the module, so that analyses can see through calls.
+// The passes are registered by name in pass_manager.h.
+
+struct pass_context {
+    const ir::Module &module;
+    const cost_model &costs;
+    const call_effects *calls = nullptr; // nullptr: every call may do anything
+};
+
+class passes {
+public:
+    /*
+     * Removes li instructions whose register is written again in the same block before it is read.
+     * @return bool - true if the function changed
+     */
+    static bool dead_li(ir::Function &function, const pass_context &) {
+        bool changed = false;
+        for (auto &block : function.blocks) {
+            std::vector<ir::Instr> result;
+            for (size_t i = 0; i < block.instrs.size(); i++) {
+                const ir::Instr &instr = block.instrs[i];
+                bool dead = false;
+                if (instr.op == ir::LI) {
+                    for (size_t j = i + 1; j < block.instrs.size(); j++) {
+                        if (ir::reads(block.instrs[j], instr.reg[0])) {
+                            break;
+                        }
+                        if (ir::writes(block.instrs[j], instr.reg[0])) {
+                            dead = true;
+                            break;
+                        }
+                    }
+                }
+                if (dead) {
+                    changed = true;
+                } else {
+                    result.push_back(instr);
+                }
+            }
+            block.instrs = std::move(result);
+        }
+        return changed;
+    }
+
+    /*
+     * True if a pass may add writes of reg to the function. Callers only expect the registers the function already
+     * clobbers (see summaries) to change, functions that are never called may write any register.
+     */
+    static bool may_clobber(const ir::Function &function, const pass_context &context, int reg) {
+        if (!context.calls) {
+            return true; // every call is assumed to clobber everything
+        }
+        auto found = context.calls->functions.find(function.name);
+        if (found == context.calls->functions.end() || found->second.clobbers.contains(reg)) {
+            return true;
+        }
+        for (const auto &caller : context.module.functions) {
+            for (const auto &block : caller.blocks) {
+                for (const auto &instr : block.instrs) {
+                    if (instr.op == ir::CALL && instr.symbol == function.name) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Makes the reads of the li at instrs[index], which sets reg, use other instead, so that the li can be removed.
+     * Only done if every read of the li is in the same block, other keeps its value until the last of them and the
+     * reads are explicit operands (not the implicit ones of call, syscall and ret), see also needs_own_li.
+     * @return bool - false if nothing was changed
+     */
+    static bool rename_reads(std::vector<ir::Instr> &instrs, size_t index, int reg, int other,
+                             const liveness::Set &live_out) {
+        if (needs_own_li(instrs, index, reg)) {
+            return false;
+        }
+        std::vector<std::pair<size_t, int>> operands; // instruction and operand reading reg
+        bool other_changed = false;
+        bool redefined = false;
+        for (size_t j = index + 1; j < instrs.size() && !redefined; j++) {
+            const ir::Instr &instr = instrs[j];
+            if (ir::reads(instr, reg)) {
+                if (other_changed || instr.op == ir::CALL || instr.op == ir::SYSCALL || instr.op == ir::RET) {
+                    return false;
+                }
+                int count = instr.op == ir::LOAD ? 1 : 2;
+                for (int k = 0; k < count; k++) {
+                    if (instr.reg[k] == reg) {
+                        operands.emplace_back(j, k);
+                    }
+                }
+            }
+            redefined = ir::writes(instr, reg);
+            other_changed = other_changed || ir::writes(instr, other);
+        }
+        if (!redefined && live_out.contains(reg)) {
+            return false;
+        }
+        for (auto [j, k] : operands) {
+            instrs[j].reg[k] = other;
+        }
+        return true;
+    }
+
+    // True if the register set at instrs[index] is read as a request window or a jump condition before it is written
+    // again in the block. Those keep their own li: the request passes read windows from it and an unconditional jump
+    // is recognized by the li 0 of its condition (see ir::is_unconditional_jump).
+    static bool needs_own_li(const std::vector<ir::Instr> &instrs, size_t index, int reg) {
+        for (size_t j = index + 1; j < instrs.size(); j++) {
+            if ((instrs[j].op == ir::REQUEST && instrs[j].reg[1] == reg) ||
+                (instrs[j].op == ir::JMP_EQ_Z && instrs[j].reg[0] == reg)) {
+                return true;
+            }
+            if (ir::writes(instrs[j], reg)) {
+                break;
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Removes li instructions of constants that are already in a register: the li is dropped if its register holds the
+     * value already, otherwise its reads are moved to a register that holds it (see rename_reads). Privileged addresses
+     * are the main case, every access materializes its address with its own li.
+     * A moved read leaves the old value in the register of the li, so the constants are computed again after every
+     * block that changed. With a back edge an earlier block could depend on the block as well, there a block is only
+     * changed if the constants at its end stay the same.
+     * Request windows are kept in their own li, so this runs after the windows are sized.
+     * @return bool - true if an li was removed
+     */
+    static bool reuse_constants(ir::Function &function, const pass_context &context) {
+        ir::CFG cfg(function);
+        bool cyclic = false;
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            for (size_t s : cfg.successors[b]) {
+                cyclic = cyclic || s <= b;
+            }
+        }
+        bool changed = false;
+        bool again = true;
+        while (again) {
+            again = false;
+            constants consts(function, cfg, context.calls);
+            liveness live(function, cfg, context.calls);
+            for (size_t b = 0; b < function.blocks.size() && !again; b++) {
+                if (!consts.reachable[b]) {
+                    continue;
+                }
+                // edited on a copy, the block is only replaced if the edit is kept
+                std::vector<ir::Instr> instrs = function.blocks[b].instrs;
+                constants::State state = consts.in[b];
+                std::vector<bool> removed(instrs.size(), false);
+                bool block_changed = false;
+                for (size_t i = 0; i < instrs.size(); i++) {
+                    const ir::Instr &instr = instrs[i];
+                    if (instr.op == ir::LI && instr.symbol.empty()) {
+                        int reg = instr.reg[0];
+                        if (constants::value(state, reg) == instr.imm) {
+                            removed[i] = !needs_own_li(instrs, i, reg);
+                        }
+                        for (int other = 0; other < ir::NUMBER_REGISTERS && !removed[i]; other++) {
+                            if (other != reg && other != ir::STACK_POINTER && other != ir::BASE_POINTER &&
+                                constants::value(state, other) == instr.imm) {
+                                removed[i] = rename_reads(instrs, i, reg, other, live.live_out[b]);
+                            }
+                        }
+                    }
+                    if (removed[i]) {
+                        block_changed = true;
+                        continue; // the register keeps its previous value
+                    }
+                    constants::step(instr, state, context.calls);
+                }
+                if (!block_changed) {
+                    continue;
+                }
+                if (cyclic) {
+                    constants::State before = consts.in[b];
+                    for (const auto &instr : function.blocks[b].instrs) {
+                        constants::step(instr, before, context.calls);
+                    }
+                    if (before != state) {
+                        continue;
+                    }
+                }
+                std::vector<ir::Instr> result;
+                for (size_t i = 0; i < instrs.size(); i++) {
+                    if (!removed[i]) {
+                        result.push_back(instrs[i]);
+                    }
+                }
+                function.blocks[b].instrs = std::move(result);
+                changed = true;
+                again = true;
+            }
+        }
+        return changed;
+    }
+};
+
+#endif //PASSES_H
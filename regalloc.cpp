@@ -0,0 +1 @@
+#include "regalloc.h"
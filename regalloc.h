@@ -0,0 +1,792 @@
+#ifndef REGALLOC_H
+#define REGALLOC_H
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "ir.h"
+#include "costmodel.h"
+
+// Register allocation
+//
+// The transpiler gives every value its own virtual register (the numbers from ir::NUMBER_REGISTERS on) and only names
+// machine registers where the ABI fixes them: 0 to 2 for syscall arguments, 2 to 4 for call arguments, 0 for results,
+// 5 for the return address, 6 and 7 for the stack and base pointer (see the calling convention in ir.h). The allocator
+// maps the virtual registers to the machine registers 0 to 5 so that values that are live at the same time never
+// share a register and no value sits in a fixed register while the ABI uses it. Calls only clobber the registers of
+// their lowering, the values that are live across a call are pushed and popped around it once the registers are
+// known (insert_call_saves). The return address is a value like any other: a leaf function keeps it in register 5,
+// a function that calls saves it with the other values live across the call.
+//
+// When the registers run out, the allocator picks values to spill. A spilled value lives in a slot of the stack frame
+// of its function (RBP + slot): every definition is stored to the slot and every use is reloaded into a new short
+// lived virtual register (spill), then the allocation is repeated. These temporaries are never spilled themselves.
+// Values defined by a single li (constants, privileged addresses, jump targets) are rematerialized instead: the li is
+// repeated before every use for one cycle, where a store and a reload would cost 15.
+// The frame is set up at the entry of the function and torn down before its returns (insert_frame):
+//
+//     entry function              li 0 <slots>; add 6 0 6              RBP = stack start, slots at RBP + 0 on
+//     other functions, prologue   store 6 7; li 7 <words>; add 6 7 6; sub 6 7 7
+//                                                                      saves RBP at RSP, RBP = old RSP, slots at RBP + 1 on
+//     other functions, epilogue   li 6 0; add 6 7 6; load 7 7          RSP = RBP, RBP = saved RBP
+//
+//     -O0, -O1   copies are coalesced first (coalesce), then linear scan: one pass over the live intervals in the
+//                order of the code
+//     -O2, -O3   graph coloring with iterated register coalescing, see graph_coloring
+
+class register_allocator {
+public:
+    static const int ALLOCATABLE = 6; // machine registers 0 to 5
+
+    static bool is_virtual(int reg) {
+        return reg >= ir::NUMBER_REGISTERS;
+    }
+
+    // registers read by an instruction, a call reads its arguments (registers 2 to 4)
+    static std::vector<int> uses(const ir::Instr &instr) {
+        if (instr.op == ir::CALL) {
+            std::vector<int> result;
+            for (uint64_t i = 0; i < instr.imm; i++) {
+                result.push_back(ir::FIRST_ARGUMENT + static_cast<int>(i));
+            }
+            return result;
+        }
+        return ir::uses(instr);
+    }
+
+    // registers written by an instruction, a call writes the registers of its lowering and its result
+    static std::vector<int> defs(const ir::Instr &instr) {
+        if (instr.op == ir::CALL) {
+            return {ir::RESULT, 1, ir::RETURN_ADDRESS};
+        }
+        return ir::defs(instr);
+    }
+
+    // a copy "li dst 0; add dst src dst" (or "add src dst dst"), the ISA has no move
+    struct Copy {
+        size_t block;
+        size_t li; // index of the li, the add follows it
+        size_t add;
+        int dst;
+        int src;
+    };
+
+    // the copies of a function, in the order of the code
+    static std::vector<Copy> copies(const ir::Function &function) {
+        std::vector<Copy> result;
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = 1; i < instrs.size(); i++) {
+                const ir::Instr &li = instrs[i - 1];
+                const ir::Instr &add = instrs[i];
+                if (li.op != ir::LI || !li.symbol.empty() || li.imm != 0 || add.op != ir::ADD) {
+                    continue;
+                }
+                int dst = li.reg[0];
+                if (add.reg[2] != dst || (add.reg[0] == dst) == (add.reg[1] == dst)) {
+                    continue;
+                }
+                result.push_back({b, i - 1, i, dst, add.reg[0] == dst ? add.reg[1] : add.reg[0]});
+            }
+        }
+        return result;
+    }
+
+    /*
+     * The virtual registers whose only definition is a li of a constant or symbol, or a copy of such a register, with
+     * the li that recreates them. Such a value is not spilled but rematerialized: the li is emitted again right before
+     * every use, which costs one cycle instead of a store and a load per use.
+     */
+    static std::map<int, ir::Instr> rematerializable(const ir::Function &function) {
+        std::map<std::pair<size_t, size_t>, int> copy_from; // (block, index of the add) -> source of the copy
+        std::set<std::pair<size_t, size_t>> copy_li;
+        for (const Copy &copy : copies(function)) {
+            copy_from[{copy.block, copy.add}] = copy.src;
+            copy_li.insert({copy.block, copy.li});
+        }
+        std::map<int, ir::Instr> result;
+        std::map<int, int> source; // copied registers -> the register they copy
+        std::set<int> other;
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = 0; i < instrs.size(); i++) {
+                if (copy_li.contains({b, i})) {
+                    continue; // part of the copy below it
+                }
+                auto copy = copy_from.find({b, i});
+                for (int reg : defs(instrs[i])) {
+                    if (!is_virtual(reg) || other.contains(reg)) {
+                        continue;
+                    }
+                    auto found = result.find(copy != copy_from.end() ? copy->second : ir::NONE);
+                    if (result.contains(reg) || (instrs[i].op != ir::LI && found == result.end())) {
+                        result.erase(reg);
+                        other.insert(reg);
+                    } else if (instrs[i].op == ir::LI) {
+                        result[reg] = instrs[i];
+                    } else {
+                        result[reg] = found->second;
+                        result[reg].reg[0] = reg;
+                        source[reg] = copy->second;
+                    }
+                }
+            }
+        }
+        // a copy of a register that turned out to have more definitions is not rematerializable either
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (const auto &[reg, from] : source) {
+                if (result.contains(reg) && !result.contains(from)) {
+                    result.erase(reg);
+                    changed = true;
+                }
+            }
+        }
+        return result;
+    }
+
+    // positions: instruction k (counted over the blocks in order) reads its registers at 2k and writes them at 2k + 1
+    struct Range {
+        size_t start;
+        size_t end; // exclusive
+    };
+
+    // the positions at which a register holds a value that is still needed
+    struct Interval {
+        std::vector<Range> ranges; // sorted and disjoint
+
+        bool empty() const {
+            return ranges.empty();
+        }
+
+        size_t start() const {
+            return ranges.front().start;
+        }
+
+        size_t end() const {
+            return ranges.back().end;
+        }
+
+        void add(size_t start, size_t end) {
+            auto it = ranges.begin();
+            while (it != ranges.end() && it->end < start) {
+                ++it;
+            }
+            it = ranges.insert(it, {start, end});
+            // merge with the ranges that overlap or touch it, the first of them may start before it
+            while (std::next(it) != ranges.end() && std::next(it)->start <= it->end) {
+                it->start = std::min(it->start, std::next(it)->start);
+                it->end = std::max(it->end, std::next(it)->end);
+                ranges.erase(std::next(it));
+            }
+        }
+
+        // a register that is written at a position holds no needed value before it
+        void cut(size_t position) {
+            for (auto &range : ranges) {
+                if (range.start <= position && position < range.end) {
+                    range.start = position;
+                    return;
+                }
+            }
+        }
+
+        bool contains(size_t position) const {
+            return std::any_of(ranges.begin(), ranges.end(),
+                               [&](const Range &range) { return range.start <= position && position < range.end; });
+        }
+
+        bool intersects(const Interval &other) const {
+            auto a = ranges.begin();
+            auto b = other.ranges.begin();
+            while (a != ranges.end() && b != other.ranges.end()) {
+                if (a->end <= b->start) {
+                    ++a;
+                } else if (b->end <= a->start) {
+                    ++b;
+                } else {
+                    return true;
+                }
+            }
+            return false;
+        }
+    };
+
+    /*
+     * The registers every instruction reads, for the allocator. A machine register only counts where a definition or
+     * a parameter may reach it: a ret in a function without result does not keep register 0 live, a syscall with
+     * one argument does not keep 1 and 2 live.
+     */
+    static std::vector<std::vector<std::vector<int>>> reaching_uses(const ir::Function &function, const ir::CFG &cfg) {
+        size_t n = function.blocks.size();
+        std::vector<std::set<int>> in(n), out(n);
+        std::vector<bool> visited(n, false);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = 0; b < n; b++) {
+                std::set<int> defined;
+                if (b == 0) {
+                    for (int i = 0; i < function.num_params; i++) {
+                        defined.insert(ir::FIRST_ARGUMENT + i);
+                    }
+                    defined.insert(ir::RETURN_ADDRESS);
+                    defined.insert(ir::STACK_POINTER);
+                    defined.insert(ir::BASE_POINTER);
+                }
+                for (size_t p : cfg.predecessors[b]) {
+                    defined.insert(out[p].begin(), out[p].end());
+                }
+                in[b] = defined;
+                for (const auto &instr : function.blocks[b].instrs) {
+                    for (int reg : defs(instr)) {
+                        defined.insert(reg);
+                    }
+                }
+                if (!visited[b] || defined != out[b]) {
+                    out[b] = std::move(defined);
+                    visited[b] = true;
+                    changed = true;
+                }
+            }
+        }
+
+        std::vector<std::vector<std::vector<int>>> result(n);
+        for (size_t b = 0; b < n; b++) {
+            std::set<int> defined = in[b];
+            for (const auto &instr : function.blocks[b].instrs) {
+                std::vector<int> reads;
+                for (int reg : uses(instr)) {
+                    if (is_virtual(reg) || defined.contains(reg)) {
+                        reads.push_back(reg);
+                    }
+                }
+                result[b].push_back(std::move(reads));
+                for (int reg : defs(instr)) {
+                    defined.insert(reg);
+                }
+            }
+        }
+        return result;
+    }
+
+    // the registers live at the end of every block, with the uses of reaching_uses
+    static std::vector<std::set<int>> live_out(const ir::Function &function, const ir::CFG &cfg,
+                                               const std::vector<std::vector<std::vector<int>>> &reads) {
+        size_t n = function.blocks.size();
+        std::vector<std::set<int>> in(n), out(n);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = n; b-- > 0;) {
+                std::set<int> live;
+                for (size_t s : cfg.successors[b]) {
+                    live.insert(in[s].begin(), in[s].end());
+                }
+                out[b] = live;
+                const auto &instrs = function.blocks[b].instrs;
+                for (size_t i = instrs.size(); i-- > 0;) {
+                    for (int reg : defs(instrs[i])) {
+                        live.erase(reg);
+                    }
+                    live.insert(reads[b][i].begin(), reads[b][i].end());
+                }
+                if (live != in[b]) {
+                    in[b] = std::move(live);
+                    changed = true;
+                }
+            }
+        }
+        return out;
+    }
+
+    // the live interval of every register of a function
+    static std::map<int, Interval> build_intervals(const ir::Function &function) {
+        ir::CFG cfg(function);
+        auto reads = reaching_uses(function, cfg);
+        auto out = live_out(function, cfg, reads);
+        size_t n = function.blocks.size();
+        std::vector<size_t> first(n + 1, 0);
+        for (size_t b = 0; b < n; b++) {
+            first[b + 1] = first[b] + function.blocks[b].instrs.size();
+        }
+
+        std::map<int, Interval> intervals;
+        for (size_t b = n; b-- > 0;) {
+            size_t block_start = 2 * first[b];
+            std::set<int> live = out[b];
+            for (int reg : live) {
+                intervals[reg].add(block_start, 2 * first[b + 1]);
+            }
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = instrs.size(); i-- > 0;) {
+                size_t position = 2 * (first[b] + i);
+                for (int reg : defs(instrs[i])) {
+                    Interval &interval = intervals[reg];
+                    if (live.contains(reg)) {
+                        interval.cut(position + 1);
+                    } else {
+                        interval.add(position + 1, position + 2); // written but never read
+                    }
+                    live.erase(reg);
+                }
+                for (int reg : reads[b][i]) {
+                    intervals[reg].add(block_start, position + 1);
+                    live.insert(reg);
+                }
+            }
+        }
+        return intervals;
+    }
+
+    // replaces the virtual registers with their machine registers
+    static void rewrite(ir::Function &function, const std::map<int, int> &assignment) {
+        for (auto &block : function.blocks) {
+            for (auto &instr : block.instrs) {
+                for (int i = 0; i < ir::register_count(instr.op); i++) {
+                    auto found = assignment.find(instr.reg[i]);
+                    if (found != assignment.end()) {
+                        instr.reg[i] = found->second;
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * Lowers the copies of a function after allocation: a copy within one register is removed, a copy of a constant
+     * becomes the li of the constant (one cycle instead of two)
+     * @param all - the copies before allocation
+     * @param remat - the rematerializable registers before allocation
+     * @param assignment - the machine register of every virtual register
+     */
+    static void lower_copies(ir::Function &function, const std::vector<Copy> &all, const std::map<int, ir::Instr> &remat,
+                             const std::map<int, int> &assignment) {
+        auto register_of = [&](int reg) {
+            auto found = assignment.find(reg);
+            return found != assignment.end() ? found->second : reg;
+        };
+        for (size_t c = all.size(); c-- > 0;) {
+            auto &instrs = function.blocks[all[c].block].instrs;
+            auto li = instrs.begin() + static_cast<long>(all[c].li);
+            if (register_of(all[c].dst) == register_of(all[c].src)) {
+                instrs.erase(li, li + 2);
+                continue;
+            }
+            auto value = remat.find(all[c].src);
+            if (value != remat.end()) {
+                *li = value->second;
+                li->reg[0] = register_of(all[c].dst);
+                instrs.erase(li + 1);
+            }
+        }
+    }
+
+    /*
+     * Coalesces copies before linear scan: the two ends of a copy become one register when their live intervals do
+     * not intersect once the copy itself is left out, and the copy is removed. A virtual register only merges into an
+     * allocatable machine register, so argument, parameter and result copies disappear as well, unless it lives across
+     * a call or syscall. Spill temporaries are left alone, their intervals have to stay short.
+     * @param fixed - false to only merge virtual registers: a value merged into a fixed register cannot be spilled, the
+     *                fixed registers can then leave too few for the operands of an instruction
+     * @return bool - true if a copy was removed
+     */
+    static bool coalesce(ir::Function &function, const std::set<int> &temporaries, bool fixed = true) {
+        auto all = copies(function);
+        if (all.empty()) {
+            return false;
+        }
+        // the copy as a single instruction that reads the source and writes the destination
+        ir::Function probe = function;
+        for (const Copy &copy : all) {
+            probe.blocks[copy.block].instrs[copy.li] = ir::Instr(ir::EXIT);
+            probe.blocks[copy.block].instrs[copy.add] = ir::Instr(ir::ADD, copy.src, copy.src, copy.dst);
+        }
+        auto intervals = build_intervals(probe);
+        // the positions of the calls and syscalls, a value live across one of them stays virtual: in a machine
+        // register it could not be spilled, and the fixed registers of the call would leave too few for the others
+        std::vector<size_t> clobbers;
+        size_t position = 0;
+        for (const auto &block : probe.blocks) {
+            for (const auto &instr : block.instrs) {
+                if (instr.op == ir::CALL || instr.op == ir::SYSCALL) {
+                    clobbers.push_back(position);
+                }
+                position += 2;
+            }
+        }
+        auto live_across_clobber = [&](const Interval &interval) {
+            return std::any_of(clobbers.begin(), clobbers.end(), [&](size_t clobber) {
+                return interval.contains(clobber) && interval.contains(clobber + 1);
+            });
+        };
+
+        std::map<int, int> alias;
+        auto find = [&](int reg) {
+            while (alias.contains(reg)) {
+                reg = alias[reg];
+            }
+            return reg;
+        };
+        for (const Copy &copy : all) {
+            int dst = find(copy.dst);
+            int src = find(copy.src);
+            if (dst == src || temporaries.contains(dst) || temporaries.contains(src)) {
+                continue;
+            }
+            // the virtual end merges into the other one
+            int from = is_virtual(src) ? src : dst;
+            int into = from == src ? dst : src;
+            bool machine = !is_virtual(into);
+            if (!is_virtual(from) ||
+                (machine && (!fixed || into >= ALLOCATABLE || live_across_clobber(intervals[from]))) ||
+                intervals[from].intersects(intervals[into])) {
+                continue;
+            }
+            for (const Range &range : intervals[from].ranges) {
+                intervals[into].add(range.start, range.end);
+            }
+            intervals.erase(from);
+            alias[from] = into;
+        }
+        if (alias.empty()) {
+            return false;
+        }
+        std::map<int, int> assignment;
+        for (const auto &[from, into] : alias) {
+            assignment[from] = find(into);
+        }
+        rewrite(function, assignment);
+        lower_copies(function, all, {}, assignment);
+        return true;
+    }
+
+    /*
+     * Linear scan allocation (Poletto and Sarkar): the intervals of the virtual registers in the order of their start,
+     * each takes a machine register that no active interval holds and that is not fixed during the interval. Of the
+     * free registers the one that was released longest ago is taken, its old value stays available for the passes
+     * that reuse values (see cache_privileged). When no register is free, a rematerializable interval is spilled if
+     * there is one, otherwise the interval that ends last.
+     * @param temporaries - virtual registers of spill code, they are never spilled
+     * @param spilled - receives the virtual register to spill, empty if only temporaries are left
+     * @return bool - false if a register has to be spilled, the function is then unchanged
+     */
+    static bool linear_scan(ir::Function &function, const std::set<int> &temporaries, std::set<int> &spilled) {
+        auto intervals = build_intervals(function);
+        auto remat = rematerializable(function);
+        std::vector<int> order;
+        for (const auto &[reg, interval] : intervals) {
+            if (is_virtual(reg) && !interval.empty()) {
+                order.push_back(reg);
+            }
+        }
+        std::stable_sort(order.begin(), order.end(),
+                         [&](int a, int b) { return intervals[a].start() < intervals[b].start(); });
+
+        std::map<int, int> assignment;
+        std::vector<std::pair<size_t, int>> active; // end and machine register of the intervals that hold one
+        std::vector<size_t> released(ALLOCATABLE, 0);
+        for (int reg : order) {
+            const Interval &interval = intervals[reg];
+            for (auto it = active.begin(); it != active.end();) {
+                if (it->first <= interval.start()) {
+                    released[it->second] = it->first;
+                    it = active.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+            int best = ir::NONE;
+            for (int r = ALLOCATABLE - 1; r >= 0; r--) {
+                bool taken = std::any_of(active.begin(), active.end(), [&](const auto &a) { return a.second == r; });
+                auto fixed = intervals.find(r);
+                if (taken || (fixed != intervals.end() && fixed->second.intersects(interval))) {
+                    continue;
+                }
+                if (best == ir::NONE || released[r] < released[best]) {
+                    best = r;
+                }
+            }
+            if (best == ir::NONE) {
+                // rematerializable values first, then the one that ends last
+                auto better = [&](int a, int b) {
+                    if (remat.contains(a) != remat.contains(b)) {
+                        return remat.contains(a);
+                    }
+                    return intervals[a].end() > intervals[b].end();
+                };
+                int victim = temporaries.contains(reg) ? ir::NONE : reg;
+                for (const auto &[other, r] : assignment) {
+                    if (!temporaries.contains(other) && intervals[other].end() > interval.start() &&
+                        (victim == ir::NONE || better(other, victim))) {
+                        victim = other;
+                    }
+                }
+                if (victim != ir::NONE) {
+                    spilled.insert(victim);
+                }
+                return false;
+            }
+            assignment[reg] = best;
+            active.emplace_back(interval.end(), best);
+        }
+        auto all = copies(function);
+        rewrite(function, assignment);
+        lower_copies(function, all, remat, assignment);
+        return true;
+    }
+
+    /*
+     * Moves spilled virtual registers to slots of the stack frame: every definition is stored to the slot, every use
+     * reloads it into a new temporary. A copy from or to a spilled register becomes a single load or store.
+     * Rematerializable registers get no slot, their li is moved to every use instead.
+     * @param slots - the slot of every spilled register, new ones are added
+     * @param temporaries - receives the registers of the spill code
+     * @param entry - the function is the entry of the program, its slots start at RBP + 0 (see insert_frame)
+     */
+    static void spill(ir::Function &function, const std::set<int> &spilled, std::map<int, uint64_t> &slots,
+                      std::set<int> &temporaries, bool entry) {
+        int next = ir::NUMBER_REGISTERS;
+        for (const auto &block : function.blocks) {
+            for (const auto &instr : block.instrs) {
+                for (int i = 0; i < ir::register_count(instr.op); i++) {
+                    next = std::max(next, instr.reg[i] + 1);
+                }
+            }
+        }
+        auto remat = rematerializable(function);
+        std::erase_if(remat, [&](const auto &entry) { return !spilled.contains(entry.first); });
+        for (int reg : spilled) {
+            if (!remat.contains(reg) && !slots.contains(reg)) {
+                slots[reg] = (entry ? 0 : 1) + slots.size();
+            }
+        }
+        auto temporary = [&]() {
+            temporaries.insert(next);
+            return next++;
+        };
+        // the address of a slot in a register, the base pointer itself for slot 0
+        auto address = [&](int reg, std::vector<ir::Instr> &out, int into) {
+            uint64_t slot = slots[reg];
+            if (slot == 0) {
+                return static_cast<int>(ir::BASE_POINTER);
+            }
+            out.push_back(ir::Instr::li(into, slot));
+            out.emplace_back(ir::ADD, ir::BASE_POINTER, into, into);
+            return into;
+        };
+
+        auto all = copies(function);
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            auto &instrs = function.blocks[b].instrs;
+            std::set<size_t> copy_li;
+            std::map<size_t, Copy> copy_add;
+            for (const Copy &copy : all) {
+                if (copy.block == b) {
+                    copy_li.insert(copy.li);
+                    copy_add[copy.add] = copy;
+                }
+            }
+
+            std::vector<ir::Instr> result;
+            for (size_t i = 0; i < instrs.size(); i++) {
+                ir::Instr instr = instrs[i];
+                auto copy = copy_add.find(i);
+                if (copy != copy_add.end() && (spilled.contains(copy->second.dst) ||
+                                               spilled.contains(copy->second.src))) {
+                    int dst = copy->second.dst;
+                    int src = copy->second.src;
+                    auto value = remat.find(src);
+                    if (remat.contains(dst)) {
+                        // emitted again at the uses
+                    } else if (value != remat.end()) {
+                        // a copy of a constant is the li of the constant
+                        int into = spilled.contains(dst) ? temporary() : dst;
+                        ir::Instr li = value->second;
+                        li.reg[0] = into;
+                        result.push_back(li);
+                        if (into != dst) {
+                            int at = temporary();
+                            result.emplace_back(ir::STORE, address(dst, result, at), into);
+                        }
+                    } else if (spilled.contains(dst) && spilled.contains(src)) {
+                        int loaded = temporary();
+                        result.emplace_back(ir::LOAD, address(src, result, loaded), loaded);
+                        int at = temporary();
+                        result.emplace_back(ir::STORE, address(dst, result, at), loaded);
+                    } else if (spilled.contains(dst)) {
+                        int at = temporary();
+                        result.emplace_back(ir::STORE, address(dst, result, at), src);
+                    } else {
+                        // the address gets its own temporary, dst may be spilled in a later round
+                        int at = temporary();
+                        result.emplace_back(ir::LOAD, address(src, result, at), dst);
+                    }
+                    continue;
+                }
+                if (copy_li.contains(i) && i + 1 < instrs.size()) {
+                    auto next_copy = copy_add.find(i + 1);
+                    if (spilled.contains(next_copy->second.dst) || spilled.contains(next_copy->second.src)) {
+                        continue; // replaced together with its add
+                    }
+                }
+
+                if (instr.op == ir::LI && remat.contains(instr.reg[0])) {
+                    continue; // emitted again at the uses
+                }
+                std::vector<int> used, defined;
+                for (int reg : uses(instr)) {
+                    if (spilled.contains(reg)) {
+                        used.push_back(reg);
+                    }
+                }
+                for (int reg : defs(instr)) {
+                    if (spilled.contains(reg)) {
+                        defined.push_back(reg);
+                    }
+                }
+                std::map<int, int> replacement;
+                for (int reg : used) {
+                    if (!replacement.contains(reg)) {
+                        int value = temporary();
+                        replacement[reg] = value;
+                        auto li = remat.find(reg);
+                        if (li != remat.end()) {
+                            result.push_back(li->second);
+                            result.back().reg[0] = value;
+                        } else {
+                            result.emplace_back(ir::LOAD, address(reg, result, value), value);
+                        }
+                    }
+                }
+                for (int reg : defined) {
+                    if (!replacement.contains(reg)) {
+                        replacement[reg] = temporary();
+                    }
+                }
+                for (int r = 0; r < ir::register_count(instr.op); r++) {
+                    if (replacement.contains(instr.reg[r])) {
+                        instr.reg[r] = replacement[instr.reg[r]];
+                    }
+                }
+                result.push_back(instr);
+                for (int reg : defined) {
+                    int at = temporary();
+                    result.emplace_back(ir::STORE, address(reg, result, at), replacement[reg]);
+                }
+            }
+            instrs = std::move(result);
+        }
+
+        // the li of a constant whose only use was a copy to a rematerialized register is dead now
+        std::set<int> read;
+        for (const auto &block : function.blocks) {
+            for (const auto &instr : block.instrs) {
+                for (int reg : uses(instr)) {
+                    read.insert(reg);
+                }
+            }
+        }
+        for (auto &block : function.blocks) {
+            std::erase_if(block.instrs, [&](const ir::Instr &instr) {
+                return instr.op == ir::LI && is_virtual(instr.reg[0]) && !read.contains(instr.reg[0]);
+            });
+        }
+    }
+
+    /*
+     * Sets up the frame of the spill slots at the entry of a function and tears it down before its returns
+     * @return uint64_t - the words of the frame
+     */
+    static uint64_t insert_frame(ir::Function &function, uint64_t slots, bool entry) {
+        if (slots == 0 || function.blocks.empty()) {
+            return 0;
+        }
+        auto &first = function.blocks[0].instrs;
+        if (entry) {
+            // nothing is live at the entry of the program and RBP already is the start of the stack
+            first.insert(first.begin(), {ir::Instr::li(0, slots),
+                                         ir::Instr(ir::ADD, ir::STACK_POINTER, 0, ir::STACK_POINTER)});
+            return slots;
+        }
+        uint64_t words = slots + 1;
+        // the parameters are live, the base pointer is the only free register once it is saved
+        first.insert(first.begin(), {ir::Instr(ir::STORE, ir::STACK_POINTER, ir::BASE_POINTER),
+                                     ir::Instr::li(ir::BASE_POINTER, words),
+                                     ir::Instr(ir::ADD, ir::STACK_POINTER, ir::BASE_POINTER, ir::STACK_POINTER),
+                                     ir::Instr(ir::SUB, ir::STACK_POINTER, ir::BASE_POINTER, ir::BASE_POINTER)});
+        for (auto &block : function.blocks) {
+            if (block.instrs.empty() || block.instrs.back().op != ir::RET) {
+                continue;
+            }
+            block.instrs.insert(block.instrs.end() - 1,
+                                {ir::Instr::li(ir::STACK_POINTER, 0),
+                                 ir::Instr(ir::ADD, ir::STACK_POINTER, ir::BASE_POINTER, ir::STACK_POINTER),
+                                 ir::Instr(ir::LOAD, ir::BASE_POINTER, ir::BASE_POINTER)});
+        }
+        return words;
+    }
+
+    /*
+     * Pushes the registers that are live across a call before it and pops them after it. Register 1 is free at
+     * both points (the lowering of the call overwrites it) and holds the 1 to move the stack pointer. The registers
+     * the call sequence sets itself hold no value across it.
+     * @return uint64_t - the most words pushed at a call
+     */
+    static uint64_t insert_call_saves(ir::Function &function) {
+        uint64_t pushed = 0;
+        ir::CFG cfg(function);
+        auto reads = reaching_uses(function, cfg);
+        auto out = live_out(function, cfg, reads);
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            auto &instrs = function.blocks[b].instrs;
+            // the registers live after every instruction
+            std::vector<std::set<int>> live_after(instrs.size());
+            std::set<int> live = out[b];
+            for (size_t i = instrs.size(); i-- > 0;) {
+                live_after[i] = live;
+                for (int reg : defs(instrs[i])) {
+                    live.erase(reg);
+                }
+                live.insert(reads[b][i].begin(), reads[b][i].end());
+            }
+
+            std::vector<ir::Instr> result;
+            for (size_t i = 0; i < instrs.size(); i++) {
+                std::vector<int> saved;
+                if (instrs[i].op == ir::CALL) {
+                    auto clobbered = defs(instrs[i]);
+                    for (int reg : live_after[i]) {
+                        if (reg < ALLOCATABLE && std::find(clobbered.begin(), clobbered.end(), reg) == clobbered.end()) {
+                            saved.push_back(reg);
+                        }
+                    }
+                }
+                pushed = std::max<uint64_t>(pushed, saved.size());
+                if (!saved.empty()) {
+                    result.push_back(ir::Instr::li(1, 1));
+                    for (int reg : saved) {
+                        result.emplace_back(ir::STORE, ir::STACK_POINTER, reg);
+                        result.emplace_back(ir::ADD, ir::STACK_POINTER, 1, ir::STACK_POINTER);
+                    }
+                }
+                result.push_back(instrs[i]);
+                if (!saved.empty()) {
+                    result.push_back(ir::Instr::li(1, 1));
+                    for (size_t s = saved.size(); s-- > 0;) {
+                        result.emplace_back(ir::SUB, ir::STACK_POINTER, 1, ir::STACK_POINTER);
+                        result.emplace_back(ir::LOAD, ir::STACK_POINTER, saved[s]);
+                    }
+                }
+            }
+            instrs = std::move(result);
+        }
+        return pushed;
+    }
+};
+
+#endif //REGALLOC_H
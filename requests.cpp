@@ -0,0 +1 @@
+#include "requests.h"
@@ -0,0 +1,813 @@
+#ifndef REQUESTS_H
+#define REQUESTS_H
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <optional>
+#include <vector>
+
+#include "ir.h"
+#include "costmodel.h"
+#include "analysis.h"
+#include "passes.h"
+
+// Passes on the request instructions
+//
+// "request <addr> <cycles>" grants access to one privileged address for the number of cycles in its second register,
+// which is set by li. A request covers the loads and stores of its address that complete inside the window, up to the
+// next request of the same address. Windows are measured along the longest path through the control flow of the
+// function (jumps only go forward, so it is acyclic). Calls, ret and exit end a window.
+
+class request_passes {
+public:
+    using States = std::vector<std::vector<constants::State>>; // known registers before every instruction
+
+    static States all_states(const ir::Function &function, const constants &consts) {
+        States states(function.blocks.size());
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            states[b] = consts.states(function, b);
+        }
+        return states;
+    }
+
+    static bool is_access(const ir::Instr &instr) {
+        return instr.op == ir::LOAD || instr.op == ir::STORE;
+    }
+
+    // the address a load, store or request works on, if it is a known constant
+    static std::optional<uint64_t> address(const ir::Instr &instr, const constants::State &state) {
+        if (!is_access(instr) && instr.op != ir::REQUEST) {
+            return std::nullopt;
+        }
+        return constants::value(state, instr.reg[0]);
+    }
+
+    // index of the li in the same block that sets the cycle register of the request at index, with the summaries
+    // of calls a li before a call that keeps the register is found as well
+    static std::optional<size_t> window_li(const ir::Block &block, size_t index, const call_effects *calls = nullptr) {
+        int reg = block.instrs[index].reg[1];
+        for (size_t j = index; j-- > 0;) {
+            auto defs = call_effects::defs(block.instrs[j], calls);
+            if (std::find(defs.begin(), defs.end(), reg) != defs.end()) {
+                if (block.instrs[j].op == ir::LI && block.instrs[j].symbol.empty()) {
+                    return j;
+                }
+                return std::nullopt;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // the window requested by the request at (block, index)
+    static uint64_t requested_window(const ir::Function &function, const States &states, size_t block, size_t index,
+                                     const cost_model &costs) {
+        const ir::Block &b = function.blocks[block];
+        if (auto li = window_li(b, index)) {
+            return b.instrs[*li].imm;
+        }
+        auto value = constants::value(states[block][index], b.instrs[index].reg[1]);
+        return value ? *value : costs.load_window;
+    }
+
+    static uint64_t cycles(const ir::Function &function, const States &states, size_t block, size_t index,
+                           const cost_model &costs) {
+        const ir::Instr &instr = function.blocks[block].instrs[index];
+        if (instr.op == ir::REQUEST) {
+            return costs.request_cycles(requested_window(function, states, block, index, costs));
+        }
+        return costs.instruction_cycles(instr);
+    }
+
+    using Position = std::pair<size_t, size_t>; // block and index of an instruction
+
+    /*
+     * Finds the loads and stores of the address of the request at (block, index) that are reached from it, with the
+     * longest distance from the end of the request to the end of the access.
+     * Paths end at calls, ret and exit, and at the next request of the same address unless through_requests is set;
+     * such requests are then counted with 0 cycles (they are about to be removed).
+     * @return the reached accesses, nullopt if the address is unknown or the control flow goes backwards
+     */
+    static std::optional<std::map<Position, uint64_t>> reach(const ir::Function &function, const ir::CFG &cfg,
+                                                             const States &states, size_t block, size_t index,
+                                                             const cost_model &costs, bool through_requests = false) {
+        auto addr = address(function.blocks[block].instrs[index], states[block][index]);
+        if (!addr) {
+            return std::nullopt;
+        }
+        size_t n = function.blocks.size();
+        std::vector<std::optional<uint64_t>> entry(n);
+        std::map<Position, uint64_t> reached;
+
+        // walks a block from start with distance d, false on a backward edge
+        auto walk = [&](size_t b, size_t start, uint64_t d) {
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = start; i < instrs.size(); i++) {
+                const ir::Instr &instr = instrs[i];
+                auto instr_addr = address(instr, states[b][i]);
+                if (is_access(instr) && instr_addr == addr) {
+                    uint64_t &distance = reached[{b, i}];
+                    distance = std::max(distance, costs.access_window(d, instr));
+                }
+                bool same_request = instr.op == ir::REQUEST && instr_addr == addr;
+                if ((same_request && !through_requests) || instr.op == ir::CALL || instr.op == ir::RET ||
+                    instr.op == ir::EXIT) {
+                    return true;
+                }
+                if (!same_request) {
+                    d += cycles(function, states, b, i, costs);
+                }
+            }
+            for (size_t s : cfg.successors[b]) {
+                if (s <= b) {
+                    return false;
+                }
+                entry[s] = std::max(entry[s].value_or(0), d);
+            }
+            return true;
+        };
+
+        if (!walk(block, index + 1, 0)) {
+            return std::nullopt;
+        }
+        for (size_t b = block + 1; b < n; b++) {
+            if (entry[b] && !walk(b, 0, *entry[b])) {
+                return std::nullopt;
+            }
+        }
+        return reached;
+    }
+
+    /*
+     * Computes the window the request at (block, index) needs to cover all loads and stores of its address that it
+     * guards: the longest distance from the end of the request to the end of such an access.
+     * @return the window (0 if it guards nothing), nullopt if the address is unknown or the control flow goes backwards
+     */
+    static std::optional<uint64_t> needed_window(const ir::Function &function, const ir::CFG &cfg,
+                                                 const States &states, size_t block, size_t index,
+                                                 const cost_model &costs) {
+        auto reached = reach(function, cfg, states, block, index, costs);
+        if (!reached) {
+            return std::nullopt;
+        }
+        uint64_t needed = 0;
+        for (const auto &[position, distance] : *reached) {
+            needed = std::max(needed, distance);
+        }
+        return needed;
+    }
+
+    // true if the register set by the li at index li is read by nothing but the instruction at index use
+    static bool only_feeds(const ir::Function &function, const liveness &live, size_t block, size_t li, size_t use) {
+        const auto &instrs = function.blocks[block].instrs;
+        int reg = instrs[li].reg[0];
+        auto contains = [reg](const std::vector<int> &regs) {
+            return std::find(regs.begin(), regs.end(), reg) != regs.end();
+        };
+        for (size_t j = li + 1; j < instrs.size(); j++) {
+            if (j != use && contains(call_effects::uses(instrs[j], live.calls))) {
+                return false;
+            }
+            if (contains(call_effects::defs(instrs[j], live.calls))) {
+                return j >= use;
+            }
+        }
+        return !live.live_out[block].contains(reg);
+    }
+
+    static std::set<uint64_t> privileged_addresses(const ir::Module &module) {
+        std::set<uint64_t> addresses;
+        for (const auto &[name, addr] : module.privileged) {
+            addresses.insert(addr);
+        }
+        return addresses;
+    }
+
+    // removes the instructions at the given positions
+    static void erase(ir::Function &function, const std::set<Position> &positions) {
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            auto &instrs = function.blocks[b].instrs;
+            std::vector<ir::Instr> kept;
+            for (size_t i = 0; i < instrs.size(); i++) {
+                if (!positions.contains({b, i})) {
+                    kept.push_back(std::move(instrs[i]));
+                }
+            }
+            instrs = std::move(kept);
+        }
+    }
+
+    // true if there is a call strictly between the two positions in the linear order of the function
+    static bool call_between(const ir::Function &function, Position from, Position to) {
+        for (size_t b = from.first; b <= to.first && b < function.blocks.size(); b++) {
+            const auto &instrs = function.blocks[b].instrs;
+            size_t start = b == from.first ? from.second + 1 : 0;
+            size_t end = b == to.first ? to.second : instrs.size();
+            for (size_t i = start; i < end; i++) {
+                if (instrs[i].op == ir::CALL) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /*
+     * Reuses privileged values that are still in a register (see availability) instead of loading them again: the load
+     * becomes a register copy. Requests that afterwards cover no access are removed together with their window li.
+     * @return bool - true if a load or request was removed
+     */
+    static bool cache_privileged(ir::Function &function, const pass_context &context) {
+        std::set<uint64_t> privileged = privileged_addresses(context.module);
+        bool changed = false;
+        {
+            ir::CFG cfg(function);
+            constants consts(function, cfg, context.calls);
+            States states = all_states(function, consts);
+            availability avail(function, cfg, consts, privileged, context.calls);
+            for (size_t b = 0; b < function.blocks.size(); b++) {
+                availability::State state = avail.in[b];
+                std::vector<ir::Instr> result;
+                for (size_t i = 0; i < function.blocks[b].instrs.size(); i++) {
+                    const ir::Instr &instr = function.blocks[b].instrs[i];
+                    auto addr = address(instr, states[b][i]);
+                    auto found = addr && instr.op == ir::LOAD ? state.find(*addr) : state.end();
+                    if (found != state.end()) {
+                        int value = instr.reg[1];
+                        if (found->second != value) {
+                            result.push_back(ir::Instr::li(value, 0));
+                            result.emplace_back(ir::ADD, value, found->second, value);
+                        }
+                        changed = true;
+                    } else {
+                        result.push_back(instr);
+                    }
+                    availability::step(instr, states[b][i], privileged, state, context.calls);
+                }
+                function.blocks[b].instrs = std::move(result);
+            }
+        }
+        if (!changed) {
+            return false;
+        }
+
+        ir::CFG cfg(function);
+        constants consts(function, cfg, context.calls);
+        States states = all_states(function, consts);
+        liveness live(function, cfg, context.calls);
+        std::set<Position> removed;
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = 0; i < instrs.size(); i++) {
+                if (instrs[i].op != ir::REQUEST || !address(instrs[i], states[b][i])) {
+                    continue;
+                }
+                auto reached = reach(function, cfg, states, b, i, context.costs);
+                if (!reached || !reached->empty()) {
+                    continue;
+                }
+                removed.insert({b, i});
+                auto li = window_li(function.blocks[b], i);
+                if (li && only_feeds(function, live, b, *li, i)) {
+                    removed.insert({b, *li});
+                }
+            }
+        }
+        erase(function, removed);
+        return true;
+    }
+
+    /*
+     * Plans the requests of every privileged address of a function.
+     * The requests of an address are split into consecutive groups; the first request of a group gets a window that
+     * covers the accesses of the whole group and the others are removed. A request can only take over a later one if
+     * they are on the same paths (its block dominates the later one and the later one post-dominates it) and no call
+     * lies between them. Every path that passes one request of a group then passes all of them and pays exactly the
+     * sum of their costs, requests on exclusive arms of a branch never end up in one group. Since a request costs
+     * request_base + x^2/d, a few long windows can be cheaper or more expensive than many short ones: dynamic
+     * programming over the requests in linear order finds the grouping with the fewest cycles on every path.
+     * @return bool - true if a request was removed
+     */
+    static bool plan_requests(ir::Function &function, const pass_context &context) {
+        const cost_model &costs = context.costs;
+        ir::CFG cfg(function);
+        constants consts(function, cfg, context.calls);
+        States states = all_states(function, consts);
+        liveness live(function, cfg, context.calls);
+        dominators dom(cfg);
+        post_dominators post(cfg);
+
+        std::set<uint64_t> privileged = privileged_addresses(context.module);
+
+        // the requests of every address in linear order and the accesses each of them guards
+        std::map<uint64_t, std::vector<Position>> requests;
+        std::map<Position, std::vector<Position>> guarded;
+        std::map<uint64_t, std::set<Position>> accesses;
+        std::set<uint64_t> unplannable; // addresses with accesses no request is known to guard
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = 0; i < instrs.size(); i++) {
+                auto addr = address(instrs[i], states[b][i]);
+                if (!addr || !privileged.contains(*addr)) {
+                    continue;
+                }
+                if (instrs[i].op != ir::REQUEST) {
+                    accesses[*addr].insert({b, i});
+                    continue;
+                }
+                requests[*addr].push_back({b, i});
+                auto reached = reach(function, cfg, states, b, i, costs);
+                if (!reached) {
+                    unplannable.insert(*addr);
+                    continue;
+                }
+                for (const auto &[access, distance] : *reached) {
+                    guarded[{b, i}].push_back(access);
+                }
+            }
+        }
+        for (const auto &[addr, reqs] : requests) {
+            for (const auto &request : reqs) {
+                for (const auto &access : guarded[request]) {
+                    accesses[addr].erase(access);
+                }
+            }
+        }
+        for (const auto &[addr, unguarded] : accesses) {
+            if (!unguarded.empty()) {
+                unplannable.insert(addr);
+            }
+        }
+
+        std::set<Position> removed;
+        for (const auto &[addr, reqs] : requests) {
+            size_t m = reqs.size();
+            if (m < 2 || unplannable.contains(addr)) {
+                continue;
+            }
+            std::vector<std::optional<std::map<Position, uint64_t>>> reached(m);
+            std::vector<bool> resizable(m);
+            for (size_t i = 0; i < m; i++) {
+                auto [b, idx] = reqs[i];
+                reached[i] = reach(function, cfg, states, b, idx, costs, true);
+                auto li = window_li(function.blocks[b], idx);
+                resizable[i] = li && only_feeds(function, live, b, *li, idx);
+            }
+
+            // best[j]: fewest cycles for the first j requests, the last group starts at from[j]
+            std::vector<uint64_t> best(m + 1, UINT64_MAX), window(m + 1, 0);
+            std::vector<size_t> from(m + 1, 0);
+            best[0] = 0;
+            for (size_t i = 0; i < m; i++) {
+                uint64_t w = 0;
+                for (size_t j = i; j < m; j++) {
+                    // request i takes over the accesses of request j
+                    if (j != i && (!reached[i] || !resizable[i] || !dom.dominates(reqs[i].first, reqs[j].first) ||
+                                   !post.post_dominates(reqs[j].first, reqs[i].first))) {
+                        break;
+                    }
+                    bool covered = true;
+                    for (const auto &access : guarded[reqs[j]]) {
+                        if (!reached[i] || !reached[i]->contains(access) || call_between(function, reqs[i], access)) {
+                            covered = false;
+                            break;
+                        }
+                        w = std::max(w, reached[i]->at(access));
+                    }
+                    if (!covered) {
+                        if (j != i) {
+                            break;
+                        }
+                        w = requested_window(function, states, reqs[i].first, reqs[i].second, costs);
+                    }
+                    uint64_t cost = best[i] + costs.request_cycles(w) + costs.cycles[ir::LI];
+                    if (cost < best[j + 1]) {
+                        best[j + 1] = cost;
+                        from[j + 1] = i;
+                        window[j + 1] = w;
+                    }
+                }
+            }
+
+            for (size_t j = m; j > 0; j = from[j]) {
+                size_t i = from[j];
+                if (j - 1 == i) {
+                    continue;
+                }
+                auto [b, idx] = reqs[i];
+                function.blocks[b].instrs[*window_li(function.blocks[b], idx)].imm = window[j];
+                for (size_t k = i + 1; k < j; k++) {
+                    removed.insert(reqs[k]);
+                    auto li = window_li(function.blocks[reqs[k].first], reqs[k].second);
+                    if (li && only_feeds(function, live, reqs[k].first, *li, reqs[k].second)) {
+                        removed.insert({reqs[k].first, *li});
+                    }
+                }
+            }
+        }
+        erase(function, removed);
+        return !removed.empty();
+    }
+
+    // the arithmetic instructions, the op of a read-modify-write
+    static bool is_arithmetic(const ir::Instr &instr) {
+        return instr.op == ir::ADD || instr.op == ir::SUB || instr.op == ir::MUL || instr.op == ir::CMP_GT;
+    }
+
+    /*
+     * Matches a read-modify-write x = x op y of a privileged address that ends with the store at (block, index): the
+     * stored value is computed by one arithmetic instruction from the value a load of the same address read. Both
+     * accesses have their own request and everything from the first request to the store is in the block, without a
+     * call in between.
+     * @return the indices of the request of the load and of the request of the store
+     */
+    static std::optional<std::pair<size_t, size_t>> read_modify_write(const ir::Function &function,
+                                                                      const States &states, size_t block,
+                                                                      size_t index, const call_effects *calls) {
+        const auto &instrs = function.blocks[block].instrs;
+        auto addr = address(instrs[index], states[block][index]);
+        if (instrs[index].op != ir::STORE || !addr) {
+            return std::nullopt;
+        }
+        // the last instruction before the given index that writes reg
+        auto definition = [&](int reg, size_t before) -> std::optional<size_t> {
+            for (size_t j = before; j-- > 0;) {
+                auto defs = call_effects::defs(instrs[j], calls);
+                if (std::find(defs.begin(), defs.end(), reg) != defs.end()) {
+                    return j;
+                }
+            }
+            return std::nullopt;
+        };
+        auto op = definition(instrs[index].reg[1], index);
+        if (!op || !is_arithmetic(instrs[*op])) {
+            return std::nullopt;
+        }
+        std::optional<size_t> load;
+        for (int operand : {instrs[*op].reg[0], instrs[*op].reg[1]}) {
+            auto def = definition(operand, *op);
+            if (def && instrs[*def].op == ir::LOAD && address(instrs[*def], states[block][*def]) == addr) {
+                load = std::max(load.value_or(0), *def);
+            }
+        }
+        if (!load) {
+            return std::nullopt;
+        }
+        std::optional<size_t> store_request;
+        for (size_t j = index; j-- > 0;) {
+            if (instrs[j].op == ir::CALL) {
+                return std::nullopt;
+            }
+            if (instrs[j].op != ir::REQUEST || address(instrs[j], states[block][j]) != addr) {
+                continue;
+            }
+            if (j < *load) {
+                if (!store_request) {
+                    return std::nullopt; // the request of the load already covers the store
+                }
+                return std::make_pair(j, *store_request);
+            }
+            if (store_request) {
+                return std::nullopt;
+            }
+            store_request = j;
+        }
+        return std::nullopt;
+    }
+
+    /*
+     * Lets the request of the load of a read-modify-write x = x op y (see read_modify_write) cover the store as well:
+     * its window is widened to the end of the store and the request of the store is removed with its window li, when
+     * one longer window costs fewer cycles than the two requests. The request of the store must guard nothing else.
+     * @return bool - true if a request was removed
+     */
+    static bool cover_read_modify_write(ir::Function &function, const pass_context &context) {
+        const cost_model &costs = context.costs;
+        bool changed = false;
+        // every change moves instructions, the analyses are redone after each one
+        for (bool found = true; found;) {
+            found = false;
+            ir::CFG cfg(function);
+            constants consts(function, cfg, context.calls);
+            States states = all_states(function, consts);
+            liveness live(function, cfg, context.calls);
+            for (size_t b = 0; b < function.blocks.size() && !found; b++) {
+                ir::Block &block = function.blocks[b];
+                for (size_t s = 0; s < block.instrs.size() && !found; s++) {
+                    auto rmw = read_modify_write(function, states, b, s, context.calls);
+                    if (!rmw) {
+                        continue;
+                    }
+                    auto [load_request, store_request] = *rmw;
+                    auto load_li = window_li(block, load_request, context.calls);
+                    auto store_li = window_li(block, store_request, context.calls);
+                    if (!load_li || !store_li || !only_feeds(function, live, b, *load_li, load_request) ||
+                        !only_feeds(function, live, b, *store_li, store_request)) {
+                        continue;
+                    }
+                    auto guarded = reach(function, cfg, states, b, store_request, costs);
+                    auto window = needed_window(function, cfg, states, b, load_request, costs);
+                    auto through = reach(function, cfg, states, b, load_request, costs, true);
+                    if (!guarded || guarded->size() != 1 || !guarded->contains({b, s}) || !window || !through) {
+                        continue;
+                    }
+                    // the li of the store's window is on the way to the store and goes away with the request
+                    uint64_t longer = std::max(*window, through->at({b, s}) - costs.cycles[ir::LI]);
+                    uint64_t separate = costs.request_cycles(*window) + costs.request_cycles(guarded->at({b, s})) +
+                                        costs.cycles[ir::LI];
+                    if (costs.request_cycles(longer) >= separate) {
+                        continue;
+                    }
+                    block.instrs[*load_li].imm = longer;
+                    erase(function, {{b, store_request}, {b, *store_li}});
+                    found = changed = true;
+                }
+            }
+        }
+        return changed;
+    }
+
+    /*
+     * Finds the first request of addr on every path that starts at (block, start).
+     * @return the requests, nullopt if a path ends (call, ret, exit, end of the function) or goes backwards first, or
+     *         enters a block that block does not dominate (a path from elsewhere joins it before the request)
+     */
+    static std::optional<std::set<Position>> first_requests(const ir::Function &function, const ir::CFG &cfg,
+                                                             const States &states, size_t block, size_t start,
+                                                             uint64_t addr) {
+        dominators dom(cfg);
+        std::vector<bool> entered(function.blocks.size(), false);
+        std::set<Position> found;
+        auto walk = [&](size_t b, size_t from) {
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = from; i < instrs.size(); i++) {
+                if (instrs[i].op == ir::REQUEST && address(instrs[i], states[b][i]) == addr) {
+                    found.insert({b, i});
+                    return true;
+                }
+                if (instrs[i].op == ir::CALL || instrs[i].op == ir::RET || instrs[i].op == ir::EXIT) {
+                    return false;
+                }
+            }
+            if (cfg.successors[b].empty()) {
+                return false;
+            }
+            for (size_t s : cfg.successors[b]) {
+                if (s <= b || !dom.dominates(block, s)) {
+                    return false;
+                }
+                entered[s] = true;
+            }
+            return true;
+        };
+        if (!walk(block, start)) {
+            return std::nullopt;
+        }
+        for (size_t b = block + 1; b < function.blocks.size(); b++) {
+            if (entered[b] && !walk(b, 0)) {
+                return std::nullopt;
+            }
+        }
+        return found;
+    }
+
+    /*
+     * Checks that every load and store of addr reached from the request at (block, index) has a request of addr after
+     * the last call on every path to it. A request that is first on one path after a branch can be behind a call on
+     * another path that joins it, the access it guards then still needs it. Paths that do not pass the request join
+     * at the blocks that block does not dominate, no request covers them there.
+     * @return bool - false if an access is reached by a path on which a call, ret or exit came after the last request,
+     *         or that does not pass the request
+     */
+    static bool covered_on_all_paths(const ir::Function &function, const ir::CFG &cfg, const States &states,
+                                     size_t block, size_t index, uint64_t addr) {
+        size_t n = function.blocks.size();
+        dominators dom(cfg);
+        std::vector<std::optional<bool>> entry(n); // covered on every path into the block, nullopt if not reached
+        auto walk = [&](size_t b, size_t start, bool covered) {
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = start; i < instrs.size(); i++) {
+                const ir::Instr &instr = instrs[i];
+                auto instr_addr = address(instr, states[b][i]);
+                if (is_access(instr) && instr_addr == addr && !covered) {
+                    return false;
+                }
+                if (instr.op == ir::REQUEST && instr_addr == addr) {
+                    covered = true;
+                } else if (instr.op == ir::CALL) {
+                    covered = false;
+                } else if (instr.op == ir::RET || instr.op == ir::EXIT) {
+                    return true;
+                }
+            }
+            for (size_t s : cfg.successors[b]) {
+                if (s <= b) {
+                    return false;
+                }
+                entry[s] = entry[s].value_or(true) && covered && dom.dominates(block, s);
+            }
+            return true;
+        };
+        if (!walk(block, index + 1, true)) {
+            return false;
+        }
+        for (size_t b = block + 1; b < n; b++) {
+            if (entry[b] && !walk(b, 0, *entry[b])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Replaces the first requests of addr after the branch at the end of block by one request before the branch.
+     * @return the new function, nullopt if not every path after the branch requests addr, an access of a removed
+     *         request is also reached after a call or no registers are free
+     */
+    static std::optional<ir::Function> hoist_request(const ir::Function &function, const pass_context &context,
+                                                     size_t block, uint64_t addr) {
+        const cost_model &costs = context.costs;
+        ir::CFG cfg(function);
+        constants consts(function, cfg, context.calls);
+        States states = all_states(function, consts);
+        liveness live(function, cfg, context.calls);
+        size_t branch = function.blocks[block].instrs.size() - 1;
+        auto first = first_requests(function, cfg, states, block, branch, addr);
+        if (!first || first->size() < 2) {
+            return std::nullopt;
+        }
+
+        // two registers that are free at the branch hold the address and the window
+        liveness::Set used = live.live_out[block];
+        liveness::step(function.blocks[block].instrs[branch], used, context.calls);
+        std::vector<int> free;
+        for (int reg = 0; reg < ir::NUMBER_REGISTERS && free.size() < 2; reg++) {
+            if (!used.contains(reg) && reg != ir::STACK_POINTER && reg != ir::BASE_POINTER &&
+                passes::may_clobber(function, context, reg)) {
+                free.push_back(reg);
+            }
+        }
+        if (free.size() < 2) {
+            return std::nullopt;
+        }
+
+        ir::Function result = function;
+        std::set<Position> removed = *first;
+        for (auto [b, i] : *first) {
+            auto li = window_li(function.blocks[b], i);
+            if (li && only_feeds(function, live, b, *li, i)) {
+                removed.insert({b, *li});
+            }
+        }
+        erase(result, removed);
+        auto &instrs = result.blocks[block].instrs;
+        instrs.insert(instrs.begin() + static_cast<long>(branch),
+                      {ir::Instr::li(free[0], addr), ir::Instr::li(free[1], 0), ir::Instr(ir::REQUEST, free[0], free[1])});
+
+        ir::CFG result_cfg(result);
+        constants result_consts(result, result_cfg, context.calls);
+        States result_states = all_states(result, result_consts);
+        if (!covered_on_all_paths(result, result_cfg, result_states, block, branch + 2, addr)) {
+            return std::nullopt;
+        }
+        auto window = needed_window(result, result_cfg, result_states, block, branch + 2, costs);
+        if (!window) {
+            return std::nullopt;
+        }
+        instrs[branch + 1].imm = *window;
+        return result;
+    }
+
+    /*
+     * Hoists the requests of an address from the paths after a branch to one request before it, e.g. for
+     *
+     *     if (c) { g = 1; } else { g = 2; }
+     *     g = 3;
+     *
+     * the requests of both arms become one request before the jmpEqZ, whose window also spans the jump and the longer
+     * arm. Every path then has one request less for plan-requests to merge with later requests of the address (here the
+     * one after the join point). The hoist is only kept if, after planning, the most expensive path gets cheaper (or
+     * stays the same and the function gets cheaper overall).
+     * @return bool - true if a request was hoisted
+     */
+    static bool hoist_requests(ir::Function &function, const pass_context &context) {
+        const cost_model &costs = context.costs;
+        std::set<uint64_t> privileged = privileged_addresses(context.module);
+        auto planned = [&](ir::Function f) {
+            plan_requests(f, context);
+            return std::make_pair(costs.longest_path(f), costs.estimate(f));
+        };
+
+        bool changed = false;
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            const auto &instrs = function.blocks[b].instrs;
+            if (instrs.empty() || instrs.back().op != ir::JMP_EQ_Z || ir::is_unconditional_jump(function.blocks[b],
+                                                                                              instrs.size() - 1)) {
+                continue;
+            }
+            for (uint64_t addr : privileged) {
+                auto hoisted = hoist_request(function, context, b, addr);
+                if (hoisted && planned(*hoisted) < planned(function)) {
+                    function = std::move(*hoisted);
+                    changed = true;
+                }
+            }
+        }
+        return changed;
+    }
+
+    /*
+     * Keeps hot privileged addresses in registers the function does not use otherwise: the address is set once at the
+     * entry and reuse_constants turns the li of every later access into a read of that register. A pin is kept only if
+     * the cost model estimates the function to get cheaper with it.
+     * @return bool - true if an address was pinned
+     */
+    static bool pin_addresses(ir::Function &function, const pass_context &context) {
+        if (function.blocks.empty()) {
+            return false;
+        }
+        std::set<uint64_t> privileged = privileged_addresses(context.module);
+        std::vector<bool> used(ir::NUMBER_REGISTERS, false); // including the implicit ones of call, syscall and ret
+        std::map<uint64_t, size_t> count;
+        for (const auto &block : function.blocks) {
+            for (const auto &instr : block.instrs) {
+                for (int reg : call_effects::uses(instr, context.calls)) {
+                    used[reg] = true;
+                }
+                for (int reg : call_effects::defs(instr, context.calls)) {
+                    used[reg] = true;
+                }
+                if (instr.op == ir::LI && instr.symbol.empty() && privileged.contains(instr.imm)) {
+                    count[instr.imm]++;
+                }
+            }
+        }
+        used[ir::STACK_POINTER] = used[ir::BASE_POINTER] = true;
+        for (int reg = 0; reg < ir::NUMBER_REGISTERS; reg++) {
+            used[reg] = used[reg] || !passes::may_clobber(function, context, reg);
+        }
+
+        std::vector<std::pair<size_t, uint64_t>> hot; // number of li, address
+        for (const auto &[addr, n] : count) {
+            if (n >= 2) {
+                hot.emplace_back(n, addr);
+            }
+        }
+        std::sort(hot.rbegin(), hot.rend());
+
+        bool changed = false;
+        for (const auto &[n, addr] : hot) {
+            auto free = std::find(used.begin(), used.end(), false);
+            if (free == used.end()) {
+                break;
+            }
+            int reg = static_cast<int>(free - used.begin());
+            ir::Function without = function;
+            passes::reuse_constants(without, context);
+            ir::Function with = function;
+            with.blocks[0].instrs.insert(with.blocks[0].instrs.begin(), ir::Instr::li(reg, addr));
+            passes::reuse_constants(with, context);
+            if (context.costs.estimate(with) < context.costs.estimate(without)) {
+                function = std::move(with);
+                used[reg] = true;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    /*
+     * Post-scheduling pass: sets the window of every request to exactly the cycles its guarded loads and stores need.
+     * Must run after every pass that moves or inserts instructions.
+     * @return bool - true if a window changed
+     */
+    static bool size_requests(ir::Function &function, const pass_context &context) {
+        ir::CFG cfg(function);
+        constants consts(function, cfg, context.calls);
+        States states = all_states(function, consts);
+        liveness live(function, cfg, context.calls);
+
+        // later requests first, their windows are part of the distances of earlier ones
+        bool changed = false;
+        for (size_t b = function.blocks.size(); b-- > 0;) {
+            auto &instrs = function.blocks[b].instrs;
+            for (size_t i = instrs.size(); i-- > 0;) {
+                if (instrs[i].op != ir::REQUEST) {
+                    continue;
+                }
+                auto needed = needed_window(function, cfg, states, b, i, context.costs);
+                auto li = window_li(function.blocks[b], i, context.calls);
+                if (!needed || !li || !only_feeds(function, live, b, *li, i)) {
+                    continue;
+                }
+                if (instrs[*li].imm != *needed) {
+                    instrs[*li].imm = *needed;
+                    changed = true;
+                }
+            }
+        }
+        return changed;
+    }
+};
+
+#endif //REQUESTS_H
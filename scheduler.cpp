@@ -0,0 +1 @@
+#include "scheduler.h"
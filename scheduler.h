@@ -0,0 +1,152 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <algorithm>
+#include <optional>
+#include <set>
+#include <vector>
+
+#include "ir.h"
+#include "analysis.h"
+#include "passes.h"
+#include "dependences.h"
+
+// Instruction scheduling within basic blocks
+//
+// Every cycle between a request and the last access it guards is paid for in the window, and a request costs
+// request_base + x^2/d for a window of x cycles. The list scheduler below therefore opens windows as late as possible and
+// only schedules what the pending accesses need while a window is open; independent work moves before the request or
+// after the access, only the dependences of dependence_graph are kept. The order of the block is kept where nothing is
+// gained, so running it twice changes nothing.
+
+class scheduler {
+public:
+    /*
+     * List schedule of a block that keeps request windows short
+     * @param preds - the instructions every instruction has to wait for (see dependence_graph)
+     * @return the new order as indices into the block
+     */
+    static std::vector<size_t> schedule(const ir::Block &block, const std::vector<constants::State> &states,
+                                        const std::vector<std::vector<size_t>> &preds) {
+        const auto &instrs = block.instrs;
+        size_t n = instrs.size();
+
+        std::vector<size_t> waiting(n);
+        std::vector<std::vector<size_t>> succs(n);
+        for (size_t i = 0; i < n; i++) {
+            waiting[i] = preds[i].size();
+            for (size_t p : preds[i]) {
+                succs[p].push_back(i);
+            }
+        }
+
+        // the accesses of the block a request guards, up to the next request of its address
+        auto guarded = [&](size_t r) {
+            std::vector<size_t> result;
+            auto addr = constants::value(states[r], instrs[r].reg[0]);
+            for (size_t j = r + 1; j < n && addr; j++) {
+                auto other = constants::value(states[j], instrs[j].reg[0]);
+                if (instrs[j].op == ir::REQUEST && other == addr) {
+                    break;
+                }
+                if ((instrs[j].op == ir::LOAD || instrs[j].op == ir::STORE) && other == addr) {
+                    result.push_back(j);
+                }
+            }
+            return result;
+        };
+
+        std::vector<size_t> order;
+        std::vector<bool> done(n, false);
+        std::set<size_t> pending; // accesses of open windows
+        // the pending accesses and what they still wait for, found along the dependence edges when a window opens;
+        // what is done already is not followed, everything before it is done as well
+        std::vector<bool> needed(n, false);
+        auto need = [&](size_t access) {
+            std::vector<size_t> stack = {access};
+            needed[access] = true;
+            while (!stack.empty()) {
+                size_t j = stack.back();
+                stack.pop_back();
+                for (size_t p : preds[j]) {
+                    if (!done[p] && !needed[p]) {
+                        needed[p] = true;
+                        stack.push_back(p);
+                    }
+                }
+            }
+        };
+        while (order.size() < n) {
+            std::optional<size_t> pick, request, terminator;
+            for (size_t i = 0; i < n && !pick; i++) {
+                if (done[i] || waiting[i] > 0) {
+                    continue;
+                }
+                if (!pending.empty()) {
+                    // inside a window only what the pending accesses need
+                    if (needed[i]) {
+                        pick = i;
+                    }
+                } else if (instrs[i].op == ir::REQUEST) {
+                    request = request.value_or(i);
+                } else if (ir::is_terminator(instrs[i].op)) {
+                    terminator = i;
+                } else {
+                    pick = i;
+                }
+            }
+            if (!pick) {
+                pick = request ? request : terminator;
+            }
+            if (!pick) {
+                // a window waits for something that is not ready, give up on keeping it short
+                for (size_t i = 0; i < n && !pick; i++) {
+                    if (!done[i] && waiting[i] == 0) {
+                        pick = i;
+                    }
+                }
+                pending.clear();
+                needed.assign(n, false);
+            }
+            size_t i = *pick;
+            done[i] = true;
+            order.push_back(i);
+            pending.erase(i);
+            if (instrs[i].op == ir::REQUEST) {
+                for (size_t access : guarded(i)) {
+                    pending.insert(access);
+                    need(access);
+                }
+            }
+            for (size_t s : succs[i]) {
+                waiting[s]--;
+            }
+        }
+        return order;
+    }
+
+    /*
+     * Reorders every block so that request windows are as short as possible (see schedule).
+     * Runs before the windows are sized.
+     * @return bool - true if an instruction moved
+     */
+    static bool schedule_windows(ir::Function &function, const pass_context &context) {
+        ir::CFG cfg(function);
+        constants consts(function, cfg, context.calls);
+        bool changed = false;
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            auto &block = function.blocks[b];
+            auto states = consts.states(function, b);
+            auto order = schedule(block, states, dependence_graph(block, states, context.calls).predecessors());
+            std::vector<ir::Instr> result;
+            for (size_t i = 0; i < order.size(); i++) {
+                changed = changed || order[i] != i;
+                result.push_back(block.instrs[order[i]]);
+            }
+            block.instrs = std::move(result);
+        }
+        return changed;
+    }
+};
+
+#endif //SCHEDULER_H
@@ -0,0 +1,69 @@
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "simulator.h"
+
+// Runs a compiled program (text or binary form) in the simulator and prints its trace and cycles.
+//
+// usage: jitsim [-p <address>,<address>,...] [--cost-model <file>] <program>
+
+int main(int argc, char **argv) {
+    cost_model costs;
+    std::set<uint64_t> privileged;
+    const char *in_file = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            std::string_view list = argv[++i];
+            size_t pos = 0;
+            while (pos <= list.size()) {
+                size_t end = list.find(',', pos);
+                if (end == std::string_view::npos) {
+                    end = list.size();
+                }
+                uint64_t addr;
+                if (!bytecode::parse_number(list.substr(pos, end - pos), addr)) {
+                    fprintf(stderr, "Error: invalid address list\n");
+                    return 1;
+                }
+                privileged.insert(addr);
+                pos = end + 1;
+            }
+        } else if (strcmp(argv[i], "--cost-model") == 0 && i + 1 < argc) {
+            if (!costs.load(argv[++i])) {
+                return 1;
+            }
+        } else {
+            in_file = argv[i];
+        }
+    }
+    if (!in_file) {
+        printf("usage: jitsim [-p <address>,<address>,...] [--cost-model <file>] <program>\n");
+        return 1;
+    }
+
+    std::ifstream in(in_file, std::ios::binary);
+    if (!in) {
+        fprintf(stderr, "Error: could not open file\n");
+        return 1;
+    }
+    std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    std::vector<bytecode::Instruction> program;
+    if (!simulator::parse(data, program)) {
+        fprintf(stderr, "Error: malformed program\n");
+        return 1;
+    }
+
+    simulator sim;
+    bool stopped = sim.run(program, privileged, costs);
+    for (const auto &line : sim.trace) {
+        printf("%s\n", line.c_str());
+    }
+    printf("cycles %llu\n", static_cast<unsigned long long>(sim.cycles));
+    if (!stopped) {
+        fprintf(stderr, "Error: the program did not stop after %llu instructions\n",
+                static_cast<unsigned long long>(sim.steps));
+        return 1;
+    }
+    return 0;
+}
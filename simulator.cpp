@@ -0,0 +1 @@
+#include "simulator.h"
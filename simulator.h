@@ -0,0 +1,175 @@
+#ifndef SIMULATOR_H
+#define SIMULATOR_H
+
+#include <cstdint>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "bytecode.h"
+#include "costmodel.h"
+#include "ir.h"
+
+// Simulator of the target VM, the tests use it to check what a compiled program does and how many cycles it takes
+//
+// Registers and memory start at 0. Every instruction takes the cycles of the cost model. A request of address a with
+// window x opens a window of x cycles at a once the request completed, a load or store of a privileged address needs
+// an open window with at least its own cycles left. jmpEqZ jumps to the 1-based line in its second register, exit or
+// running off the end stops the program. Syscalls do nothing but show up in the trace.
+//
+// The trace is what the outside world sees of a run, in order:
+//
+//     syscall <number> <register 0> <register 1> <register 2>
+//     store <address> <value>                  a store that changes a privileged address
+//     violation <op> <address> line <line>     a load or store of a privileged address outside a window
+
+class simulator {
+public:
+    std::vector<std::string> trace;
+    uint64_t cycles = 0;
+    uint64_t steps = 0;
+
+    /*
+     * Parses a program in the text form (as written to output.in) or in the binary form (see bytecode.h)
+     * @return bool - false if the program is malformed
+     */
+    static bool parse(std::string_view data, std::vector<bytecode::Instruction> &program) {
+        if (data.size() >= sizeof(bytecode::MAGIC) &&
+            data.compare(0, sizeof(bytecode::MAGIC), bytecode::MAGIC, sizeof(bytecode::MAGIC)) == 0) {
+            bytecode::decoder dec(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+            bytecode::Instruction instruction;
+            while (dec.next(instruction)) {
+                program.push_back(instruction);
+            }
+            return dec.ok();
+        }
+        size_t pos = 0;
+        while (pos < data.size()) {
+            size_t end = data.find('\n', pos);
+            if (end == std::string_view::npos) {
+                end = data.size();
+            }
+            auto words = bytecode::split(data.substr(pos, end - pos));
+            pos = end + 1;
+            if (words.empty()) {
+                continue;
+            }
+            bytecode::Instruction instruction;
+            if (!bytecode::parse_opcode(words[0], instruction.op)) {
+                return false;
+            }
+            size_t registers = bytecode::register_count(instruction.op);
+            if (words.size() != 1 + registers + (instruction.op == bytecode::LI)) {
+                return false;
+            }
+            for (size_t i = 0; i < registers; i++) {
+                uint64_t reg;
+                if (!bytecode::parse_number(words[1 + i], reg) || reg >= ir::NUMBER_REGISTERS) {
+                    return false;
+                }
+                instruction.reg[i] = static_cast<uint8_t>(reg);
+            }
+            if (instruction.op == bytecode::LI && !bytecode::parse_number(words[2], instruction.imm)) {
+                return false;
+            }
+            program.push_back(instruction);
+        }
+        return true;
+    }
+
+    /*
+     * Runs a program to its end
+     * @param privileged - the privileged addresses, accesses of other addresses need no window
+     * @param limit - the maximal number of executed instructions
+     * @return bool - false if the program did not stop within limit instructions or reached an invalid instruction
+     */
+    bool run(const std::vector<bytecode::Instruction> &program, const std::set<uint64_t> &privileged,
+             const cost_model &costs, uint64_t limit = 10000000) {
+        uint64_t reg[ir::NUMBER_REGISTERS] = {};
+        std::map<uint64_t, uint64_t> memory;
+        std::map<uint64_t, int64_t> windows; // cycles left of the open windows
+        uint64_t pc = 0;
+        for (steps = 0; pc < program.size(); steps++) {
+            if (steps == limit) {
+                return false;
+            }
+            const bytecode::Instruction &instr = program[pc++];
+            const uint8_t *r = instr.reg;
+            uint64_t elapsed = costs.cycles[instr.op];
+            switch (instr.op) {
+                case bytecode::EXIT:
+                    return true;
+                case bytecode::ADD:
+                    reg[r[2]] = reg[r[0]] + reg[r[1]];
+                    break;
+                case bytecode::SUB:
+                    reg[r[2]] = reg[r[0]] - reg[r[1]];
+                    break;
+                case bytecode::MUL:
+                    reg[r[2]] = reg[r[0]] * reg[r[1]];
+                    break;
+                case bytecode::CMP_GT:
+                    reg[r[2]] = reg[r[0]] > reg[r[1]];
+                    break;
+                case bytecode::LI:
+                    reg[r[0]] = instr.imm;
+                    break;
+                case bytecode::LOAD:
+                case bytecode::STORE: {
+                    uint64_t addr = reg[r[0]];
+                    if (privileged.contains(addr)) {
+                        auto open = windows.find(addr);
+                        if (open == windows.end() || open->second < static_cast<int64_t>(elapsed)) {
+                            trace.push_back(std::string("violation ") + bytecode::mnemonic(instr.op) + " " +
+                                            std::to_string(addr) + " line " + std::to_string(pc));
+                        }
+                    }
+                    if (instr.op == bytecode::LOAD) {
+                        auto value = memory.find(addr);
+                        reg[r[1]] = value != memory.end() ? value->second : 0;
+                    } else {
+                        uint64_t &value = memory[addr];
+                        if (privileged.contains(addr) && value != reg[r[1]]) {
+                            trace.push_back("store " + std::to_string(addr) + " " + std::to_string(reg[r[1]]));
+                        }
+                        value = reg[r[1]];
+                    }
+                    break;
+                }
+                case bytecode::REQUEST:
+                    elapsed = costs.request_cycles(reg[r[1]]);
+                    elapse(windows, elapsed);
+                    cycles += elapsed;
+                    windows[reg[r[0]]] = static_cast<int64_t>(reg[r[1]]);
+                    continue;
+                case bytecode::JMP_EQ_Z:
+                    if (reg[r[0]] == 0) {
+                        pc = reg[r[1]] - 1;
+                    }
+                    break;
+                case bytecode::SYSCALL:
+                    trace.push_back("syscall " + std::to_string(reg[r[0]]) + " " + std::to_string(reg[0]) + " " +
+                                    std::to_string(reg[1]) + " " + std::to_string(reg[2]));
+                    break;
+                default:
+                    return false;
+            }
+            elapse(windows, elapsed);
+            cycles += elapsed;
+        }
+        return true;
+    }
+
+private:
+    static void elapse(std::map<uint64_t, int64_t> &windows, uint64_t cycles) {
+        for (auto it = windows.begin(); it != windows.end();) {
+            it->second -= static_cast<int64_t>(cycles);
+            it = it->second < 0 ? windows.erase(it) : std::next(it);
+        }
+    }
+};
+
+#endif //SIMULATOR_H
@@ -0,0 +1,83 @@
+# Compiles a regression program at -O0, -O1 and -O2, runs it in the simulator and compares the result with the
+# expected file next to it
+#
+#     cmake -DCOMPILER=<hackatum2024> -DSIMULATOR=<jitsim> -DPROGRAM=<name.txt> -DEXPECTED=<name.expected>
+#           -DWORK=<directory> -P check.cmake
+#
+# Every line of the expected file that is not a bound is a line of the trace (see simulator.h), the trace has to be
+# the same at every level. A bound limits the simulated cycles of a level to a number or to the cycles of another
+# level, '#' starts a comment:
+#
+#     O1 <= 120
+#     O2 <= O1
+
+get_filename_component(name ${PROGRAM} NAME_WE)
+
+# the privileged addresses declared by "// (name,address)"
+file(STRINGS ${PROGRAM} declarations REGEX "^//[ ]*\\([^,]*,[ ]*[0-9]+[ ]*\\)")
+set(addresses "")
+foreach(declaration ${declarations})
+    string(REGEX REPLACE "^//[ ]*\\([^,]*,[ ]*([0-9]+)[ ]*\\).*" "\\1" address "${declaration}")
+    list(APPEND addresses ${address})
+endforeach()
+list(JOIN addresses "," addresses)
+set(privileged "")
+if(addresses)
+    set(privileged -p ${addresses})
+endif()
+
+set(expected_trace "")
+set(bounds "")
+file(STRINGS ${EXPECTED} lines)
+foreach(line ${lines})
+    string(STRIP "${line}" line)
+    if(line STREQUAL "" OR line MATCHES "^#")
+        continue()
+    elseif(line MATCHES "^O[0-9] <= (O[0-9]|[0-9]+)$")
+        list(APPEND bounds "${line}")
+    else()
+        list(APPEND expected_trace "${line}")
+    endif()
+endforeach()
+
+set(failed FALSE)
+foreach(level 0 1 2)
+    set(output ${WORK}/${name}_O${level}.out)
+    execute_process(COMMAND ${COMPILER} -O${level} -o ${output} ${PROGRAM}
+                    RESULT_VARIABLE result OUTPUT_QUIET ERROR_VARIABLE errors)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "-O${level}: compilation failed\n${errors}")
+    endif()
+    execute_process(COMMAND ${SIMULATOR} ${privileged} ${output}
+                    RESULT_VARIABLE result OUTPUT_VARIABLE run ERROR_VARIABLE errors)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "-O${level}: simulation failed\n${errors}")
+    endif()
+    string(REGEX REPLACE "\n$" "" run "${run}")
+    string(REPLACE "\n" ";" trace "${run}")
+    list(POP_BACK trace last)
+    string(REGEX REPLACE "^cycles " "" cycles_O${level} "${last}")
+    if(NOT trace STREQUAL expected_trace)
+        list(JOIN trace "\n    " got)
+        list(JOIN expected_trace "\n    " want)
+        message(SEND_ERROR "-O${level}: unexpected trace\n  got\n    ${got}\n  expected\n    ${want}")
+        set(failed TRUE)
+    endif()
+    message(STATUS "-O${level}: ${cycles_O${level}} cycles")
+endforeach()
+
+foreach(bound ${bounds})
+    string(REGEX REPLACE "^O([0-9]) <= (.*)$" "\\1" level "${bound}")
+    string(REGEX REPLACE "^O([0-9]) <= (.*)$" "\\2" limit "${bound}")
+    if(limit MATCHES "^O([0-9])$")
+        set(limit ${cycles_O${CMAKE_MATCH_1}})
+    endif()
+    if(cycles_O${level} GREATER limit)
+        message(SEND_ERROR "-O${level}: ${cycles_O${level}} cycles, expected at most ${limit} (${bound})")
+        set(failed TRUE)
+    endif()
+endforeach()
+
+if(failed)
+    message(FATAL_ERROR "${name} does not match ${EXPECTED}")
+endif()
@@ -1,13 +1,23 @@
 #ifndef TRANSPILER_H
 #define TRANSPILER_H
 #include <unordered_map>
+#include <unordered_set>
 #include <array>
-#include <fstream>
-#include <sstream>
+#include <map>
+#include <set>
 #include <string>
-#include <regex>
 
 #include "parser.h"
+#include "bytecode.h"
+#include "object.h"
+#include "ir.h"
+#include "pass_manager.h"
+#include "costmodel.h"
+#include "writer.h"
+#include "verifier.h"
+#include "memory_map.h"
+#include "regalloc.h"
+#include "coloring.h"
 
 // Valid instructions:
 // exit
@@ -22,84 +32,117 @@
 // syscall <reg_syscall_num>
 // cmpGT <reg_1> <reg_2> <reg_out>
 
-// TODO: dynamically choose stack placement based on privileged data locations
-static const int START_OF_STACK = 9216;
 static const int RBP = 7; // base pointer is in register 7
 static const int RSP = 6; // stack pointer is in register 6
 static const std::string PRIV_PREFIX = "privileged-";
-static const std::string LOAD_CYCLES = "30";
-static const std::string STORE_CYCLES = "20";
 static const uint16_t NUMBER_REGISTERS = 8;
 
 class transpiler {
 
     std::unordered_map<std::string, bool> privilegedObjects; // maps an identifier to a boolean value that says whether it is priveleged or not
-    std::array<bool, NUMBER_REGISTERS> occupiedRegister = {false}; // says whether register i is used currently
     std::unordered_map<std::string, std::string> registers; // maps identifier to registers for non privileged data
     std::unordered_map<std::string, std::string> privilegedAddresses; // maps identifier to address for privileged data
+    int next_register = NUMBER_REGISTERS; // the next virtual register of the current function
+    std::string return_address; // virtual register with the return address of the current function, empty in main
+    int label_counter = 0; // makes the jump labels of a function unique
+    int optimization_level = 2; // see set_optimization_level
+    cost_model costs; // cycle costs of the target
+    // a new virtual register, the register allocator maps it to a machine register (see register_allocator)
+    std::string new_register() {
+        return std::to_string(next_register++);
+    }
 
-    std::string push_registers(std::array<bool, NUMBER_REGISTERS> occupiedRegister) {
-        std::string output_string;
-        // push the registers to the stack
-        // put 1 into free register to increment RSP
-        std::string free_register = get_free_register();
-        output_string += "li " + free_register + " 1\n";
-        for (int i = 1; i < NUMBER_REGISTERS; i++) {
-            if (occupiedRegister[i]) {
-                output_string += "store " + std::to_string(RSP) + " " + std::to_string(i) + "\n";
-                // increment the stack pointer
-                output_string += "add " + std::to_string(RSP) + " " + free_register + " " + std::to_string(RSP) + "\n";
-                // increment the base pointer
-                // TODO: if many registers used
-                output_string += "add " + std::to_string(RBP) + " " + free_register + " " + std::to_string(RBP) + "\n";
-            }
+    // copies a register (the ISA has no move)
+    static void copy(const std::string &from, const std::string &to, std::string &output_string) {
+        if (from == to) {
+            return;
         }
-        // push the stack pointer
-        output_string += "store " + std::to_string(RSP) + " " + std::to_string(RSP) + "\n";
-        // increment the stack pointer
-        output_string += "add " + std::to_string(RSP) + " " + free_register + " " + std::to_string(RSP) + "\n";
-        // push the base pointer
-        output_string += "store " + std::to_string(RSP) + " " + std::to_string(RBP) + "\n";
-        // set the base pointer to the stack pointer
-        output_string += "mul " + std::to_string(RSP) + " " + free_register + " " + std::to_string(RSP) + "\n";
-        return output_string;
+        output_string += "li " + to + " 0\n";
+        output_string += "add " + to + " " + from + " " + to + "\n";
     }
-    std::string pop_registers(std::array<bool, NUMBER_REGISTERS> occupiedRegister, std::string label) {
-        std::string output_string;
-        // pop the registers to the stack
-        // put 1 into free register to subtract RSP
-        std::string free_register = get_free_register();
-        output_string += "li " + free_register + " 1\n";
-        for (int i = NUMBER_REGISTERS - 1; i >= 1; i--) {
-            if (occupiedRegister[i]) {
-                output_string += "load " + std::to_string(RSP) + " " + std::to_string(i) + "\n";
-                // subtract the stack pointer
-                output_string += "sub " + std::to_string(RSP) + " " + free_register + " " + std::to_string(RSP) + "\n";
-                // increment the base pointer
-                // TODO: if many registers used
-                output_string += "sub " + std::to_string(RBP) + " " + free_register + " " + std::to_string(RBP) + "\n";
+
+    /*
+     * Loads a privileged object, the request covers the load
+     * @param destination - the register that receives the value, empty for a new register
+     * @return the register holding the value
+     */
+    std::string load_privileged(const std::string &address, std::string &output_string,
+                                const std::string &destination = "") {
+        std::string address_register = new_register();
+        output_string += "li " + address_register + " " + address + "\n";
+        // store number of cycles in another register
+        std::string cycles_register = new_register();
+        output_string += "li " + cycles_register + " " + std::to_string(costs.load_window) + "\n";
+        output_string += "request " + address_register + " " + cycles_register + "\n";
+        std::string value_register = destination.empty() ? new_register() : destination;
+        output_string += "load " + address_register + " " + value_register + "\n";
+        return value_register;
+    }
+
+    // the value of an operand in a register, privileged objects are loaded
+    std::string operand_value(const std::string &operand, std::string &output_string) {
+        if (operand.starts_with(PRIV_PREFIX)) {
+            return load_privileged(operand.substr(PRIV_PREFIX.length()), output_string);
+        }
+        return operand;
+    }
+
+    // true if evaluating the expression calls, makes a syscall or assigns, its order to other expressions then matters
+    static bool has_side_effects(parser::ExprNode *expr) {
+        switch (expr->type) {
+            case parser::EXPR:
+                return has_side_effects(expr->expr);
+            case parser::FUNC_CALL: case parser::SYS_CALL:
+                return true;
+            case parser::BIN_OP: {
+                auto binOpNode = static_cast<parser::BinOpNode *>(expr);
+                return binOpNode->op == parser::ASS || has_side_effects(binOpNode->lhs) ||
+                       has_side_effects(binOpNode->rhs);
             }
+            default:
+                return false;
         }
-        // pop the stack pointer
-        output_string += "store " + std::to_string(RSP) + " " + std::to_string(RSP) + "\n";
-        // decrement the stack pointer
-        output_string += "sub " + std::to_string(RSP) + " " + free_register + " " + std::to_string(RSP) + "\n";
-        // push the base pointer
-        output_string += "load " + std::to_string(RSP) + " " + std::to_string(RBP) + "\n";
-        // set the base pointer to the stack pointer
-        // output_string += "mul " + std::to_string(RSP) + " " + std::to_string(free_register) + " " + std::to_string(RSP) + "\n";
-        return output_string;
     }
 
-    // TODO: deal with no free registers
-    std::string get_free_register() {
-        for (int i = NUMBER_REGISTERS - 1; i >= 0; i--) {
-            if (occupiedRegister[i] == false) {
-                return std::to_string(i);
+    /*
+     * Ershov number of an expression: the registers its evaluation needs at once (Sethi and Ullman). A privileged
+     * object needs two for the address and the cycles of its request, a comparison that is negated needs two for its
+     * result and the 1.
+     */
+    int registers_needed(parser::ExprNode *expr) const {
+        switch (expr->type) {
+            case parser::EXPR:
+                return registers_needed(expr->expr);
+            case parser::IDENTIFIER: {
+                auto found = privilegedObjects.find(static_cast<parser::IdentifierNode *>(expr)->value);
+                return found != privilegedObjects.end() && found->second ? 2 : 1;
+            }
+            case parser::BIN_OP: {
+                auto binOpNode = static_cast<parser::BinOpNode *>(expr);
+                int left = registers_needed(binOpNode->lhs);
+                int right = registers_needed(binOpNode->rhs);
+                int needed = left == right ? left + 1 : std::max(left, right);
+                switch (binOpNode->op) {
+                    case parser::LE: case parser::GE: case parser::EQ:
+                        return std::max(needed, 2);
+                    default:
+                        return needed;
+                }
             }
+            default:
+                return 1;
         }
-        printf("Error: no free registers\n");
-        return "Error";
+    }
+
+    // stores a value to a privileged object
+    void store_privileged(const std::string &address, const std::string &value_register, std::string &output_string) {
+        std::string address_register = new_register();
+        output_string += "li " + address_register + " " + address + "\n";
+        // store number of cycles in another register
+        std::string cycles_register = new_register();
+        output_string += "li " + cycles_register + " " + std::to_string(costs.store_window) + "\n";
+        output_string += "request " + address_register + " " + cycles_register + "\n";
+        output_string += "store " + address_register + " " + value_register + "\n";
     }
 
     std::string transpile_func_call(parser::FuncCallNode* funcCall, std::string& output_string) {
@@ -108,26 +151,66 @@ class transpiler {
         // get the arguments
         std::vector<parser::ExprNode*> args = funcCall->args->args;
 
-        // push the registers to the stack
-        output_string += push_registers(occupiedRegister);
-        std::string pop_instructions = pop_registers(occupiedRegister, funcName);
-        for (int i = 0; i < funcCall->args->args.size(); i++) {
-            parser::ExprNode* node = funcCall->args->args.at(i);
-            auto result_register = transpile_expr(node, output_string);
-            output_string += "li " + std::to_string(i + 2) + " 0\n";
-            output_string += "add " + std::to_string(i + 2) + result_register+ std::to_string(i + 2) + "\n";
-            occupiedRegister[std::stoi(result_register)] = false;
-            occupiedRegister[i + 2] = true;
+        if (args.size() > ir::MAX_ARGUMENTS) {
+            fprintf(stderr, "Error: more than %d arguments in call of %s\n", ir::MAX_ARGUMENTS, funcName.c_str());
+            return "Error: too many arguments";
+        }
+        std::vector<std::string> values;
+        for (auto arg : args) {
+            values.push_back(operand_value(transpile_expr(arg, output_string), output_string));
+        }
+        // the arguments go to registers 2 to 4 right before the call, the values live across the call are saved
+        // around it after register allocation (see register_allocator::insert_call_saves)
+        for (size_t i = 0; i < values.size(); i++) {
+            copy(values[i], std::to_string(ir::FIRST_ARGUMENT + i), output_string);
+        }
+        // jump to the function with the return address in register 5 (see ir::lower)
+        output_string += "call " + funcName + " " + std::to_string(args.size()) + "\n";
+        // the result is in register 0 until the next call or syscall
+        std::string result_register = new_register();
+        copy(std::to_string(ir::RESULT), result_register, output_string);
+        return result_register;
+    }
+
+    std::string transpile_sys_call(parser::SysCallNode *sysCall, std::string &output_string) {
+        std::vector<parser::ExprNode*> args = sysCall->args->args;
+        std::vector<std::string> values;
+        for (auto arg : args) {
+            values.push_back(operand_value(transpile_expr(arg, output_string), output_string));
+        }
+        // the arguments go to registers 0 to 2 right before the syscall
+        for (size_t i = 0; i < values.size(); i++) {
+            copy(values[i], std::to_string(i), output_string);
+        }
+        // the syscall number goes into another register (see syscalls in analysis.h)
+        std::string syscall_number;
+        switch (sysCall->syscall) {
+            case parser::OPEN: {
+                syscall_number = "0";
+                break;
+            }
+            case parser::WRITE: {
+                // write to file
+                syscall_number = "1";
+                break;
+            }
+            case parser::READ: {
+                // read from file
+                syscall_number = "2";
+                break;
+            }
+            case parser::IOCTL: {
+                syscall_number = "3";
+                break;
+            }
         }
-        // load 0  into register 0 for jump zero
-        output_string += "li 0 0\n";
-        // put label into register 1
-        output_string += "li 1 " + funcName + "\n";
-        // jump to label
-        output_string += "jmpEqZ 0 1\n";
-        // // return to this point
-        output_string += pop_instructions;
-        return "0";
+        auto syscall_num_reg = new_register();
+        output_string += "li " + syscall_num_reg + " " + syscall_number + "\n";
+        output_string += "syscall " + syscall_num_reg + "\n";
+        // the result is in register 0 until the next call or syscall
+        std::string result_register = new_register();
+        copy("0", result_register, output_string);
+        return result_register;
     }
 
     std::string transpile_expr(parser::ExprNode* expr, std::string& output_string) {
@@ -140,66 +223,12 @@ class transpiler {
                 return result_register;
             }
             case parser::SYS_CALL: {
-                auto sysCall = static_cast<parser::SysCallNode *> (expr);
-                // TODO: push and pop
-                std::vector<parser::ExprNode*> args = sysCall->args->args;
-                int i = 0;
-                for (; i < args.size(); i++) {
-                    if (occupiedRegister[i]) {
-                        auto val = registers.find(static_cast<parser::IdentifierNode*> (args[i])->value)->second = std::to_string(i);
-                        auto free_register = get_free_register();
-                        registers[val] = free_register;
-                        output_string += "li " + free_register + " 0\n";
-                        output_string += "add " + free_register + " " + std::to_string(i) + " " + free_register + "\n";
-                    } else {
-                        occupiedRegister[i] = true;
-                    }
-                        output_string += "li " + std::to_string(i) + " 0\n";
-                    output_string += "add " + std::to_string(i) + " " + transpile_expr(args[i], output_string) + " " + std::to_string(i) + "\n";
-                }
-                std::string syscall_number;
-                auto syscall_num_reg = get_free_register();
-                switch (sysCall->syscall) {
-                    case parser::OPEN: {
-                        syscall_number = "0";
-                        output_string += "li " + syscall_num_reg + " " + syscall_number + "\n";
-                        occupiedRegister[std::stoi(syscall_num_reg)] = true;
-                        break;
-                    }
-                    case parser::WRITE: {
-                        // write to file
-                        syscall_number = "1";
-                        auto free_register = get_free_register();
-                        output_string += "li " + free_register + " 0\n";
-                        occupiedRegister[std::stoi(free_register)] = true;
-                        break;
-                    }
-
-                    case parser::READ: {
-                        // write to file
-                        syscall_number = "2";
-                        auto free_register = get_free_register();
-                        output_string += "li " + free_register + " 0\n";
-                        occupiedRegister[std::stoi(free_register)] = true;
-                        break;
-                    }
-                    case parser::IOCTL: {
-                        // write to file
-                        syscall_number = "3";
-                        auto free_register = get_free_register();
-                        output_string += "li " + free_register + " 0\n";
-                        occupiedRegister[std::stoi(free_register)] = true;
-                        break;
-                    }
-                }
-                output_string += "syscall " + syscall_number;
-                return "0";
+                return transpile_sys_call(static_cast<parser::SysCallNode *> (expr), output_string);
             }
             case parser::NUMBER: {
-                auto free_register = get_free_register();
+                auto free_register = new_register();
                 auto number = static_cast<parser::NumberNode *> (expr);
                 output_string += "li " + free_register + " " + std::to_string(number->value) + "\n";
-                occupiedRegister[std::stoi(free_register)] = true;
                 return free_register;
             }
             case parser::IDENTIFIER: {
@@ -209,8 +238,7 @@ class transpiler {
                 }
                 auto value_register = registers[value];
                 if (value_register.empty()) {
-                    value_register = get_free_register();
-                    occupiedRegister[std::stoi(value_register)] = true;
+                    value_register = new_register();
                     registers[value] = value_register;
                 }
                 return value_register;
@@ -219,190 +247,94 @@ class transpiler {
                 parser::BinOpNode *binOpNode = static_cast<parser::BinOpNode *> (expr);
                 parser::ExprNode* lhs = binOpNode->lhs;
                 parser::ExprNode* rhs = binOpNode->rhs;
-                auto lhs_register = transpile_expr(lhs, output_string);
-                auto rhs_register = transpile_expr(rhs, output_string);
+                if (binOpNode->op == parser::ASS) {
+                    auto lhs_register = transpile_expr(lhs, output_string);
+                    auto rhs_register = transpile_expr(rhs, output_string);
+                    // acquire write access
+                    if (lhs_register.starts_with(PRIV_PREFIX)) {
+                        auto value_register = operand_value(rhs_register, output_string);
+                        store_privileged(lhs_register.substr(PRIV_PREFIX.length()), value_register, output_string);
+                        return value_register;
+                    }
+                    if (rhs_register.starts_with(PRIV_PREFIX)) {
+                        // load privileged data directly into the variable
+                        return load_privileged(rhs_register.substr(PRIV_PREFIX.length()), output_string, lhs_register);
+                    }
+                    if (rhs_register != lhs_register) {
+                        copy(rhs_register, lhs_register, output_string);
+                    }
+                    return lhs_register;
+                }
+
+                // privileged operands are loaded right after they are evaluated, the operand that needs more
+                // registers goes first unless that would reorder calls, syscalls or assignments
+                std::string left_reg, right_reg;
+                if (registers_needed(rhs) > registers_needed(lhs) && !has_side_effects(lhs) &&
+                    !has_side_effects(rhs)) {
+                    right_reg = operand_value(transpile_expr(rhs, output_string), output_string);
+                    left_reg = operand_value(transpile_expr(lhs, output_string), output_string);
+                } else {
+                    left_reg = operand_value(transpile_expr(lhs, output_string), output_string);
+                    right_reg = operand_value(transpile_expr(rhs, output_string), output_string);
+                }
+                auto free_register = new_register();
                 switch (binOpNode->op) {
-                    case parser::ASS: {
-                        // acquire write access
-                        if (lhs_register.starts_with(PRIV_PREFIX)) {
-                            // also acquire read access
-                            if (rhs_register.starts_with(PRIV_PREFIX)) {
-                                // store address of rhs privileged data in free register
-                                std::string free_register_rhs = get_free_register();
-                                // mark local address register as occupied
-                                occupiedRegister[std::stoi(free_register_rhs)] = true;
-                                output_string += "li " + free_register_rhs + " " +  rhs_register.substr(PRIV_PREFIX.length())+ "\n";
-                                // store number of cycles in another free register
-                                std::string free_register_cycles = get_free_register();
-                                // mark cycle register as occupied
-                                occupiedRegister[std::stoi(free_register_cycles)] = true;
-                                output_string += "li " + free_register_cycles + " " + LOAD_CYCLES + "\n";
-                                // request access for rhs
-                                output_string += "request " + free_register_rhs + " " + free_register_cycles + "\n";
-                                // load privileged data into the first free register (re-use of register)
-                                output_string += "load " + free_register_rhs + free_register_rhs + "\n";
-
-                                // store address of lhs privileged data in free register
-                                std::string free_register_lhs = get_free_register();
-                                // free the cycles register
-                                occupiedRegister[std::stoi(free_register_cycles)] = false;
-                                output_string += "li " + free_register_lhs + " " +  lhs_register.substr(PRIV_PREFIX.length()) + "\n";
-                                // store number of cycles in second free register
-                                output_string += "li " + free_register_cycles + " " + STORE_CYCLES + "\n";
-                                // request access for lhs
-                                output_string += "request " + free_register_lhs + " " + free_register_cycles + "\n";
-                                // store rhs in lhs
-                                output_string += "store " + free_register_lhs + " " + free_register_rhs + "\n";
-                                registers[static_cast<parser::IdentifierNode*> (lhs)->value] = free_register_rhs;
-                                return free_register_rhs;
-                            } else {
-                                // store address of lhs privileged data in free register
-                                std::string free_register_lhs = get_free_register();
-                                occupiedRegister[std::stoi(free_register_lhs)] = true;
-                                output_string += "li " + free_register_lhs + " " + lhs_register.substr(PRIV_PREFIX.length()) + "\n";
-                                // store number of cycles in second free register
-                                std::string free_register_cycles = get_free_register();
-                                occupiedRegister[std::stoi(free_register_lhs)] = false;
-                                output_string += "li " + free_register_cycles + " " + STORE_CYCLES + "\n";
-                                // request access for lhs
-                                output_string += "request " + free_register_lhs + " " + free_register_cycles + "\n";
-                                // store rhs in lhs
-                                output_string += "store " + free_register_lhs + " " + rhs_register + "\n";
-                                // mark local copy as occupied
-                                registers[static_cast<parser::IdentifierNode*> (lhs)->value] = rhs_register;
-                                return rhs_register;
-                            }
-                        }
-                        if (rhs_register.starts_with(PRIV_PREFIX)) {
-                            // store address of rhs privileged data in free register
-                            std::string free_register_rhs = get_free_register();
-                            output_string += "li " + free_register_rhs + " " +  rhs_register.substr(PRIV_PREFIX.length())+ "\n";
-                            // store number of cycles in another free register
-                            std::string free_register_cycles = get_free_register();
-                            output_string += "li " + free_register_cycles + " " + LOAD_CYCLES + "\n";
-                            // request access for rhs
-                            output_string += "request " + free_register_rhs + " " + free_register_cycles + "\n";
-                            // load privileged data into the first free register (re-use of register)
-                            output_string += "load " + free_register_rhs + lhs_register + "\n";
-                            return lhs_register;
-                        } else {
-                            output_string += "li " + lhs_register + " 0\n";
-                            output_string += "add " + lhs_register + " " + rhs_register + " " + lhs_register + "\n";
-                            occupiedRegister[std::stoi(rhs_register)] = false;
-                            return lhs_register;
-                        }
+                    case parser::ADD: {
+                        // add the two values
+                        output_string += "add " + left_reg + " " + right_reg + " " + free_register + "\n";
+                        return free_register;
+                    }
+                    case parser::SUB: {
+                        // sub the two values
+                        output_string += "sub " + left_reg + " " + right_reg + " " + free_register + "\n";
+                        return free_register;
+                    }
+                    case parser::MUL: {
+                        // mul the two values
+                        output_string += "mul " + left_reg + " " + right_reg + " " + free_register + "\n";
+                        return free_register;
+                    }
+                    case parser::LT: {
+                        // compare if right_reg > left_reg
+                        output_string += "cmpGT " + right_reg + " " + left_reg + " " + free_register + "\n";
+                        return free_register;
+                    }
+                    case parser::GT: {
+                        // compare if left_reg > right_reg
+                        output_string += "cmpGT " + left_reg + " " + right_reg + " " + free_register + "\n";
+                        return free_register;
+                    }
+                    case parser::LE: {
+                        // compare if not (right_reg < left_reg)
+                        output_string += "cmpGT " + left_reg + " " + right_reg + " " + free_register + "\n";
+                        auto free_register_one = new_register();
+                        output_string += "li " + free_register_one + " 1\n";
+                        output_string += "sub " + free_register + " " + free_register_one + " " + free_register + "\n";
+                        return free_register;
+                    }
+                    case parser::GE: {
+                        // compare if not (left_reg < right_reg)
+                        output_string += "cmpGT " + right_reg + " " + left_reg + " " + free_register + "\n";
+                        auto free_register_one = new_register();
+                        output_string += "li " + free_register_one + " 1\n";
+                        output_string += "sub " + free_register + " " + free_register_one + " " + free_register + "\n";
+                        return free_register;
+                    }
+                    case parser::EQ: {
+                        // subtract the two values, if they are zero (0 < 1 == true), else false
+                        output_string += "sub " + left_reg + " " + right_reg + " " + free_register + "\n";
+                        auto free_register_one = new_register();
+                        output_string += "li " + free_register_one + " 1\n";
+                        output_string += "cmpGT " + free_register_one + " " + free_register + " " + free_register + "\n";
+                        return free_register;
+                    }
+                    case parser::NE: {
+                        // subtract the two values, if they are not zero
+                        output_string += "sub " + left_reg + " " + right_reg + " " + free_register + "\n";
+                        return free_register;
                     }
                     default: {
-                        auto left_reg = lhs_register;
-                        auto right_reg = rhs_register;
-                        if (lhs_register.starts_with(PRIV_PREFIX)) {
-                            // get register for load address
-                            std::string free_register_lhs = get_free_register();
-                            occupiedRegister[std::stoi(free_register_lhs)] = true;
-                            output_string += "li " + free_register_lhs + " " +  lhs_register.substr(PRIV_PREFIX.length()) + "\n";
-                            // get register with cycles
-                            std::string cycles_register = get_free_register();
-                            occupiedRegister[std::stoi(free_register_lhs)] = false;
-                            output_string += "li " + cycles_register + " " + LOAD_CYCLES + "\n";
-                            // request access for lhs
-                            output_string += "request " + free_register_lhs + " " + cycles_register + "\n";
-                            // replace the address in lhs with the value
-                            output_string += "load " + free_register_lhs + " " + free_register_lhs + "\n";
-                            // mark local copy as occupied
-                            registers[static_cast<parser::IdentifierNode*> (lhs)->value] = free_register_lhs;
-                            left_reg = free_register_lhs;
-                        } // else value is in lhs_register
-                        if (rhs_register.starts_with(PRIV_PREFIX)) {
-                            // get register for load address
-                            std::string free_register_rhs = get_free_register();
-                            occupiedRegister[std::stoi(free_register_rhs)] = true;
-                            output_string += "li " + free_register_rhs + " " +  rhs_register.substr(PRIV_PREFIX.length()) + "\n";
-                            // get register with cycles
-                            std::string cycles_register = get_free_register();
-                            occupiedRegister[std::stoi(free_register_rhs)] = false;
-                            output_string += "li " + cycles_register + " " + LOAD_CYCLES + "\n";
-                            // request access for rhs
-                            output_string += "request " + free_register_rhs + " " + cycles_register + "\n";
-                            // replace the address in rhs with the value
-                            output_string += "load " + free_register_rhs + " " + free_register_rhs + "\n";
-                            // mark local copy as occupied
-                            registers[static_cast<parser::IdentifierNode*> (rhs)->value] = free_register_rhs;
-                            right_reg = free_register_rhs;
-                        }
-                        switch (binOpNode->op) {
-                            case parser::ADD: {
-                                // add the two values
-                                auto free_register = get_free_register();
-                                output_string += "add " + left_reg + " " + right_reg + " " + free_register + "\n";
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                return free_register;
-                            }
-                            case parser::SUB: {
-                                // sub the two values
-                                auto free_register = get_free_register();
-                                output_string += "sub " + left_reg + " " + right_reg + " " + free_register + "\n";
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                return free_register;
-                            }
-                            case parser::MUL: {
-                                // mul the two values
-                                auto free_register = get_free_register();
-                                output_string += "mul " + left_reg + " " + right_reg + " " + free_register + "\n";
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                return free_register;
-                            }
-                            case parser::LT: {
-                                // compare if right_reg > left_reg
-                                auto free_register = get_free_register();
-                                output_string += "cmpGT " + right_reg + " " + left_reg + " " + free_register + "\n";
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                return free_register;
-                            }
-                            case parser::GT: {
-                                // compare if left_reg > right_reg
-                                auto free_register = get_free_register();
-                                output_string += "cmpGT " + left_reg + " " + right_reg + " " + free_register + "\n";
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                return free_register;
-                            }
-                            case parser::LE: {
-                                // compare if not (right_reg < left_reg)
-                                auto free_register = get_free_register();
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                output_string += "cmpGT " + left_reg + " " + right_reg + " " + free_register + "\n";
-                                auto free_register_one = get_free_register();
-                                output_string += "li " + free_register_one + " 1\n";
-                                output_string += "sub " + free_register + " " + free_register_one + " " + free_register + "\n";
-                                return free_register;
-                            }
-                            case parser::GE: {
-                                // compare if not (left_reg < right_reg)
-                                auto free_register = get_free_register();
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                output_string += "cmpGT " + right_reg + " " + left_reg + " " + free_register + "\n";
-                                auto free_register_one = get_free_register();
-                                output_string += "li " + free_register_one + " 1\n";
-                                output_string += "sub " + free_register + " " + free_register_one + " " + free_register + "\n";
-                                return free_register;
-                            }
-                            case parser::EQ: {
-                                // subtract the two values, if they are zero (0 < 1 == true), else false
-                                auto free_register = get_free_register();
-                                output_string += "sub " + left_reg + " " + right_reg + " " + free_register + "\n";
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                auto free_register_one = get_free_register();
-                                output_string += "li " + free_register_one + " 1\n";
-                                output_string += "cmpGT " + free_register_one + " " + free_register + " " + free_register + "\n";
-                                return free_register;
-                            }
-                            case parser::NE: {
-                                // subtract the two values, if they are not zero
-                                auto free_register = get_free_register();
-                                output_string += "sub " + left_reg + " " + right_reg + " " + free_register + "\n";
-                                occupiedRegister[std::stoi(free_register)] = true;
-                                return free_register;
-                            }
-                        }
+                        return "Error: unknown operator";
                     }
                 }
             } default: {
@@ -413,197 +345,162 @@ class transpiler {
     }
 
     std::string transpile_return(parser::ReturnNode* returnNode, std::string& output_string) {
+        std::string result_register;
         if (returnNode->expr) {
             // transpile the expression
-            // TODO: return value
-            std::string result_register = transpile_expr(returnNode->expr, output_string);
-            // move the result to register 0
-            output_string += "li 0 0\n";
-            output_string += "add " + result_register + " 0 0\n";
-            // move 0 to return register 1 for jump zero
-            output_string += "li 1 0\n";
-            // load 1 into register 2 for jump zero
-            //output_string += "li 2 1\n";
-            // move the return address from RBP - 1 to register 2
-            //output_string += "sub " + std::to_string(RBP) + " 2 2\n";
-            // jump to return address
-            //output_string += "jmpEqZ 1 2\n";
-            // fix out internal state
-            occupiedRegister[stoi(result_register)] = false;
-            occupiedRegister[0] = true;
+            result_register = operand_value(transpile_expr(returnNode->expr, output_string), output_string);
+        }
+        // returning from main ends the program
+        if (return_address.empty()) {
+            output_string += "exit\n";
+            return std::to_string(ir::RESULT);
+        }
+        // the result goes to register 0, ret jumps to the return address in register 5
+        if (!result_register.empty()) {
+            copy(result_register, std::to_string(ir::RESULT), output_string);
         }
-        output_string += "exit\n";
-        return "0";
+        copy(return_address, std::to_string(ir::RETURN_ADDRESS), output_string);
+        output_string += "ret\n";
+        return std::to_string(ir::RESULT);
     }
 
     void transpile_branch(parser::BranchNode* branch, std::string& output_string) {
         // transpile the condition and get the register with the resulting value
-        std::string reg = transpile_expr(branch->condition->expr, output_string);
+        std::string reg = operand_value(transpile_expr(branch->condition->expr, output_string), output_string);
 
-
-        auto free_register_label = get_free_register();
-        output_string += "li " + free_register_label + " ELSE_LABEL\n";
+        std::string label_id = std::to_string(label_counter++);
+        auto free_register_label = new_register();
+        output_string += "li " + free_register_label + " ELSE_LABEL_" + label_id + "\n";
         output_string += "jmpEqZ " + reg + " " + free_register_label + " \n";
 
-        switch (branch->statement->type) {
-            case parser::RETURN: {
-                transpile_return(static_cast<parser::ReturnNode *>(branch->statement), output_string);
+        transpile_statement(branch->statement, output_string);
+
+        auto free_register = new_register();
+        free_register_label = new_register();
+        output_string += "li " + free_register + " 0\n";
+        output_string += "li " + free_register_label + " END_LABEL_" + label_id + "\n";
+        output_string += "jmpEqZ " + free_register + " " + free_register_label + " \n";
+        output_string += "ELSE_LABEL_" + label_id + ":"; // no new_line
+
+        if (branch->else_statement) {
+            transpile_statement(branch->else_statement, output_string);
+        }
+        output_string += "END_LABEL_" + label_id + ":"; // no new_line
+    }
+
+    void transpile_statement(parser::StatementNode *statement, std::string &output_string) {
+        switch (statement->type) {
+            case parser::SCOPE: {
+                transpile_scope(static_cast<parser::ScopeNode *>(statement), output_string);
                 break;
             }
-            case parser::SCOPE: {
-                transpile_scope(static_cast<parser::ScopeNode *>(branch->statement), output_string);
+            case parser::RETURN: {
+                // transpile the return statement
+                transpile_return(static_cast<parser::ReturnNode *>(statement), output_string);
                 break;
             }
-
             case parser::BRANCH: {
-                transpile_branch(static_cast<parser::BranchNode *>(branch->statement), output_string);
+                // transpile the branch statement
+                transpile_branch(static_cast<parser::BranchNode *>(statement), output_string);
                 break;
             }
             case parser::EXPR: case parser::CONDITION: {
-                transpile_expr(static_cast<parser::ExprNode *>(branch->statement), output_string);
+                // transpile the expression
+                transpile_expr(static_cast<parser::ExprNode *>(statement), output_string);
                 break;
-
             }
             default: {
-                printf("Error: unknown statement type\n");
+                fprintf(stderr, "Error: unknown statement type\n");
                 break;
             }
         }
-
-        auto free_register = get_free_register();
-        occupiedRegister[std::stoi(free_register)] = true;
-        free_register_label = get_free_register();
-        occupiedRegister[std::stoi(free_register)] = false;
-        output_string += "li " + free_register + " 0\n";
-        output_string += "li " + free_register_label + " END_LABEL\n";
-        output_string += "jmpEqZ " + free_register + " " + free_register_label + " \n";
-        output_string += "ELSE_LABEL:"; // no new_line
-
-        if (branch->else_statement) {
-            switch (branch->else_statement->type) {
-                case parser::RETURN: {
-                    transpile_return(static_cast<parser::ReturnNode *>(branch->else_statement), output_string);
-                    break;
-                }
-                case parser::SCOPE: {
-                    transpile_scope(static_cast<parser::ScopeNode *>(branch->else_statement), output_string);
-                    break;
-                }
-                case parser::BRANCH: {
-                    transpile_branch(static_cast<parser::BranchNode *>(branch->else_statement), output_string);
-                    break;
-                }
-                case parser::EXPR: case parser::CONDITION: {
-                    transpile_expr(static_cast<parser::ExprNode *>(branch->else_statement), output_string);
-                    break;
-
-                }
-                default: {
-                    printf("Error: unknown else_statement type\n");
-                    break;
-                }
-            }
-        }
-        output_string += "END_LABEL:"; // no new_line
-
-        occupiedRegister[std::stoi(free_register)] = true;
     }
 
     // TODO: scoping (push/pop registers)
     void transpile_scope(parser::ScopeNode* scope, std::string& output_string) {
         for (parser::StatementNode *statement : scope->statements) {
-            switch (statement->type) {
-                case parser::SCOPE: {
-                    transpile_scope(static_cast<parser::ScopeNode *>(statement), output_string);
-                    break;
-                }
-                case parser::RETURN: {
-                    // transpile the return statement
-                    transpile_return(static_cast<parser::ReturnNode *>(statement), output_string);
-                    break;
-                }
-                case parser::BRANCH: {
-                    // transpile the branch statement
-                    transpile_branch(static_cast<parser::BranchNode *>(statement), output_string);
-                    break;
-                }
-                case parser::EXPR: {
-                    // transpile the expression
-                    transpile_expr(static_cast<parser::ExprNode *>(statement), output_string);
-                    break;
-                }
-                default: {
-                    printf("Error: unknown statement type\n");
-                    break;
-                }
-            }
-
-
+            transpile_statement(statement, output_string);
         }
     }
 
-    void replace_jump_labels2(std::string& output_string) {
-        // iterate through all lines (\n) and check if at the beginning there is [a-zA-Z0-9_]+:
-        std::unordered_map<std::string, uint> labels;
-        std::istringstream stream(output_string);
-        std::string line;
-        uint line_number = 1;
-
-        // Iterate through all lines
-        while (std::getline(stream, line)) {
-            // Check if the line starts with a label (e.g., "label:")
-            std::smatch match;
-            if (std::regex_search(line, match, std::regex("^([a-zA-Z0-9_]+):"))) {
-                labels[match[1].str()] = line_number;
+    /*
+     * Maps the virtual registers of a function to machine registers, linear scan up to -O1 and graph coloring from -O2
+     * on. Registers that do not fit are spilled to the stack frame and the allocation is repeated. When linear scan
+     * finds nothing left to spill, the copies merged into fixed registers are undone and only virtual registers are
+     * coalesced.
+     * @return bool - false if the function cannot be allocated
+     */
+    bool allocate_registers(ir::Function &function, bool entry) {
+        ir::Function original = function;
+        std::map<int, uint64_t> slots;
+        if (!allocate_registers(function, entry, true, slots)) {
+            if (optimization_level >= 2) {
+                fprintf(stderr, "Error: more values live at once than registers in %s\n", function.name.c_str());
+                return false;
             }
-            line_number++;
-        }
-
-        // Replace labels in the output_string
-        for (const auto& label : labels) {
-            std::string label_str = label.first + ":";
-            size_t pos = 0;
-            while ((pos = output_string.find(label_str, pos)) != std::string::npos) {
-                output_string.replace(pos, label_str.length(), "");
-                pos += std::to_string(label.second).length();
+            function = original;
+            slots.clear();
+            if (!allocate_registers(function, entry, false, slots)) {
+                fprintf(stderr, "Error: more values live at once than registers in %s\n", function.name.c_str());
+                return false;
             }
         }
+        uint64_t pushed = register_allocator::insert_call_saves(function);
+        function.frame_size = register_allocator::insert_frame(function, slots.size(), entry) + pushed;
+        return true;
     }
 
-    void replace_jump_labels(std::string& output_string) {
-        // iterate through all lines (\n) and check if at the beginning there is [a-zA-Z0-9_]+:
-        std::unordered_map<std::string, uint> labels;
-        std::istringstream stream(output_string);
-        std::string line;
-        uint line_number = 1;
-
-        // Iterate through all lines
-        while (std::getline(stream, line)) {
-            // Check if the line starts with a label (e.g., "label:")
-            std::smatch match;
-            if (std::regex_search(line, match, std::regex("^([a-zA-Z0-9_]+):"))) {
-                labels[match[1].str()] = line_number;
-            }
-            line_number++;
+    /*
+     * One attempt of allocate_registers
+     * @param fixed - whether coalescing may merge values into fixed registers
+     * @return bool - false if only spill temporaries were left to spill
+     */
+    bool allocate_registers(ir::Function &function, bool entry, bool fixed, std::map<int, uint64_t> &slots) {
+        std::set<int> temporaries;
+        if (optimization_level < 2) {
+            // graph coloring coalesces while it colors
+            register_allocator::coalesce(function, temporaries, fixed);
         }
-
-        // Replace labels in the output_string
-        for (const auto& label : labels) {
-            std::string label_str = label.first + ":";
-            size_t pos = 0;
-            while ((pos = output_string.find(label_str, pos)) != std::string::npos) {
-                output_string.replace(pos, label_str.length(), "");
-                pos += std::to_string(label.second).length();
+        while (true) {
+            std::set<int> spilled;
+            bool allocated = optimization_level < 2
+                                 ? register_allocator::linear_scan(function, temporaries, spilled)
+                                 : graph_coloring::allocate(function, costs, temporaries, spilled);
+            if (allocated) {
+                return true;
             }
-
-            // Replace labels in jmpEqZ instructions
-            std::regex jmp_regex("li\\s+(\\d+)\\s+" + label.first);
-            output_string = std::regex_replace(output_string, jmp_regex, "li $1 " + std::to_string(label.second));
+            std::erase_if(spilled, [&](int reg) { return temporaries.contains(reg); });
+            if (spilled.empty()) {
+                return false;
+            }
+            register_allocator::spill(function, spilled, slots, temporaries, entry);
         }
     }
 
 public:
-    void transpile(const char *outFile, parser::ProgramNode *root) {
+    void set_cost_model(const cost_model &model) {
+        costs = model;
+    }
+
+    /*
+     * -O0 only allocates registers, -O1 also runs the pass pipeline (see pass_manager), -O2 (the default) and -O3
+     * allocate with graph coloring instead of linear scan
+     */
+    void set_optimization_level(int level) {
+        optimization_level = level;
+    }
+
+    enum OutputFormat {
+        TEXT,   // instructions as in output.in
+        BINARY, // encoded bytecode, see bytecode.h
+        IR      // the IR after optimization, see ir.h
+    };
+
+    /*
+     * Transpiles the program and writes it to out
+     * @return bool - false if the program could not be transpiled
+     */
+    bool transpile(output_writer &out, parser::ProgramNode *root, OutputFormat format = TEXT) {
         // first determine the privileged objects and their addresses
         for (auto &privObjNode : root->privObjNodes) {
             privilegedObjects[privObjNode->identifier->value] = true;
@@ -612,58 +509,113 @@ public:
 
         // TODO: start at main, then dynamically transpile necessary functions
 
-        std::string output_string;
-
-        // // start with main by jumping there
-        // output_string += "li 0 0\n";
-        // output_string += "li 1 main\n";
-        // output_string += "jmpEqZ 0 1\n";
-
-        // then transpile the functions to intermediate code using labels
+        // then transpile every function to the IR, jumps and calls are left as symbols
+        ir::Module module;
+        for (auto &privObjNode : root->privObjNodes) {
+            module.privileged.emplace_back(privObjNode->identifier->value, privObjNode->address->value);
+        }
         for (auto &funcDefNode : root->funcDefNodes) {
             std::string funcName = funcDefNode->identifier->value;
-            // function label
-            output_string += funcName + ":"; // no new-line
-
-            // set RBP and RSP in main
-            if (funcName == "main") {
-                 output_string += "li " + std::to_string(RBP) + " " + std::to_string(START_OF_STACK) + "\n";
-                 output_string += "li " + std::to_string(RSP) + " " + std::to_string(START_OF_STACK) + "\n";
-            }
-
-            // reset our register table
-            occupiedRegister = {false};
+            std::string output_string;
+            label_counter = 0;
+    
+            // every variable and value gets its own virtual register
+            next_register = NUMBER_REGISTERS;
             registers.clear();
-            // // RSP and RBP are always occupied
-             occupiedRegister[7] = true;
-             occupiedRegister[6] = true;
-            // get parameters into registers
-            // We will simply use 0 to 7 in increasing order
-            // If more than NUMBER_REGISTERS registers are needed, the transpilation fails
+            // the parameters arrive in 2 to 4 in increasing order and are copied to virtual registers
+            // If more than MAX_ARGUMENTS registers are needed, the transpilation fails
             int num_param = 0;
             for (auto parameter : funcDefNode->params->params) {
-                if (num_param >= NUMBER_REGISTERS) {
-                    printf("Error: too many parameters\n");
-                    return;
+                if (num_param >= ir::MAX_ARGUMENTS) {
+                    fprintf(stderr, "Error: too many parameters\n");
+                    return false;
                 }
-                registers[parameter->value] = num_param;
-                occupiedRegister[num_param] = true;
+                registers[parameter->value] = new_register();
+                copy(std::to_string(ir::FIRST_ARGUMENT + num_param), registers[parameter->value], output_string);
                 num_param++;
             }
+            // the return address is a value of the function as well, coalescing keeps it in register 5 where it can
+            return_address.clear();
+            if (funcName != "main") {
+                return_address = new_register();
+                copy(std::to_string(ir::RETURN_ADDRESS), return_address, output_string);
+            }
 
-            // transpile the scope
+            // transpile the scope, a function without a return at its end returns there
             parser::ScopeNode * scope = funcDefNode->scope;
             transpile_scope(scope, output_string);
+            if (scope->statements.empty() || scope->statements.back()->type != parser::RETURN) {
+                parser::ReturnNode end(nullptr);
+                transpile_return(&end, output_string);
+            }
+
+            module.functions.emplace_back();
+            if (!ir::parse_function(funcName, static_cast<int>(funcDefNode->params->params.size()), output_string,
+                                    module.functions.back())) {
+                return false;
+            }
+        }
+
+        // map the virtual registers to machine registers
+        for (auto &function : module.functions) {
+            if (!allocate_registers(function, function.name == "main")) {
+                return false;
+            }
+        }
+
+        // place the stack clear of the privileged objects, main sets RBP and RSP if there is one, functions with an
+        // unbounded stack check it
+        memory_map memory;
+        if (!memory.plan(module)) {
+            return false;
+        }
+        for (const auto &[name, limit] : memory.stack_limits(module)) {
+            memory_map::insert_stack_check(*module.find_function(name), limit);
+        }
+        ir::Function *main = module.find_function("main");
+        if (memory.stack && main && !main->blocks.empty()) {
+            auto &entry = main->blocks[0].instrs;
+            entry.insert(entry.begin(), {ir::Instr::li(RBP, memory.stack->start), ir::Instr::li(RSP, memory.stack->start)});
+        }
+
+        // the windows were sized before register allocation, spill and rematerialization code may have landed in
+        // them since, -O0 at least sizes them again
+        pass_manager manager;
+        manager.costs = costs;
+        manager.run(module, optimization_level > 0 ? pass_manager::default_pipeline()
+                                                   : std::vector<std::string>{"size-requests"});
+#ifndef NDEBUG
+        // checked builds prove that the optimizer kept every privileged access inside a request window
+        auto report = window_verifier::verify(module, costs);
+        if (!report.ok()) {
+            fprintf(stderr, "%s", report.to_string().c_str());
+            return false;
+        }
+#endif
+
+        if (format == IR) {
+            out.write(ir::to_string(module));
+            return out.flush();
+        }
+
+        // every function becomes its own object
+        std::vector<object> objects(module.functions.size());
+        for (size_t i = 0; i < module.functions.size(); i++) {
+            if (!ir::lower(module.functions[i], objects[i])) {
+                return false;
+            }
         }
 
         // TODO: insert permissions
 
-        replace_jump_labels(output_string);
+        // lay out the functions (main first) and resolve the labels
+        std::vector<bytecode::Instruction> program;
+        if (!linker::link(objects, "main", program)) {
+            return false;
+        }
 
-        // write output to file
-        std::ofstream out(outFile);
-        out << output_string;
-        out.close();
+        out.write_program(program, format == BINARY ? output_writer::BINARY : output_writer::TEXT);
+        return out.flush();
     }
 };
 
@@ -0,0 +1 @@
+#include "verifier.h"
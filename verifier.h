@@ -0,0 +1,328 @@
+#ifndef VERIFIER_H
+#define VERIFIER_H
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "ir.h"
+#include "analysis.h"
+#include "costmodel.h"
+
+// Static check of the request windows
+//
+// Proves that every load and store of a privileged address completes inside an active window of a request for that
+// address, on every path through the function and with the cycles of the cost model. A window opens when its request
+// completes and is closed when its cycles are used up, by a call, ret or exit, or by the next request of the address.
+// Accesses through the stack and base pointer plus a constant (the frame, which the memory map keeps clear of the
+// privileged objects) are not privileged. Any other access through an address that is not constant is reported as
+// unverified, the proof does not hold for it.
+//
+// Besides the violations the report lists the slack of every request: granted cycles that no access needs.
+// The verifier shares no code with the request passes, it is the independent check of their results. Checked builds
+// (without NDEBUG) run it on the optimized module of every compilation.
+
+class window_verifier {
+public:
+    struct Violation {
+        std::string function;
+        size_t block;
+        size_t index;
+        uint64_t address;
+        std::string reason;
+    };
+
+    // an access through an address that is neither constant nor in the frame
+    struct Unverified {
+        std::string function;
+        size_t block;
+        size_t index;
+    };
+
+    struct Slack {
+        std::string function;
+        size_t block;
+        size_t index;
+        uint64_t address;
+        uint64_t window; // requested cycles
+        uint64_t needed; // cycles the covered accesses need on the longest path
+    };
+
+    struct Report {
+        std::vector<Violation> violations;
+        std::vector<Unverified> unverified;
+        std::vector<Slack> slack;
+
+        bool ok() const {
+            return violations.empty() && unverified.empty();
+        }
+
+        uint64_t total_slack() const {
+            uint64_t total = 0;
+            for (const auto &s : slack) {
+                total += s.window - s.needed;
+            }
+            return total;
+        }
+
+        std::string to_string() const {
+            std::string result;
+            for (const auto &v : violations) {
+                result += "violation: " + v.function + " block " + std::to_string(v.block) + " instruction " +
+                          std::to_string(v.index) + " address " + std::to_string(v.address) + ": " + v.reason + "\n";
+            }
+            for (const auto &u : unverified) {
+                result += "unverified: " + u.function + " block " + std::to_string(u.block) + " instruction " +
+                          std::to_string(u.index) + ": address is not constant\n";
+            }
+            for (const auto &s : slack) {
+                if (s.window > s.needed) {
+                    result += "slack: " + s.function + " block " + std::to_string(s.block) + " instruction " +
+                              std::to_string(s.index) + " address " + std::to_string(s.address) + ": window " +
+                              std::to_string(s.window) + ", needed " + std::to_string(s.needed) + "\n";
+                }
+            }
+            result += std::to_string(violations.size()) + " violations, " + std::to_string(unverified.size()) +
+                      " unverified, " + std::to_string(total_slack()) + " cycles of slack\n";
+            return result;
+        }
+    };
+
+    static Report verify(const ir::Module &module, const cost_model &costs) {
+        std::set<uint64_t> privileged;
+        for (const auto &[name, addr] : module.privileged) {
+            privileged.insert(addr);
+        }
+        call_effects calls = summaries::compute(module);
+        Report report;
+        for (const auto &function : module.functions) {
+            verify(function, privileged, costs, calls, report);
+        }
+        return report;
+    }
+
+private:
+    using Windows = std::map<uint64_t, int64_t>; // address -> cycles left in its window, on the worst path
+
+    // keeps the windows that are open in both states, with the fewer cycles left
+    static void meet(Windows &windows, const Windows &other) {
+        for (auto it = windows.begin(); it != windows.end();) {
+            auto found = other.find(it->first);
+            if (found == other.end()) {
+                it = windows.erase(it);
+            } else {
+                it->second = std::min(it->second, found->second);
+                ++it;
+            }
+        }
+    }
+
+    static void elapse(Windows &windows, uint64_t cycles) {
+        for (auto it = windows.begin(); it != windows.end();) {
+            it->second -= static_cast<int64_t>(cycles);
+            it = it->second < 0 ? windows.erase(it) : std::next(it);
+        }
+    }
+
+    static std::optional<uint64_t> window(const ir::Instr &request, const constants::State &state) {
+        return constants::value(state, request.reg[1]);
+    }
+
+    /*
+     * The registers that hold an address in the frame before every instruction of a block: the stack and base
+     * pointer, and their sums with a constant (the slot addresses of the spill code, see register_allocator::spill).
+     * Calls keep the registers their summary does not write.
+     */
+    static std::vector<std::set<int>> frame_registers(const ir::Block &block,
+                                                      const std::vector<constants::State> &states,
+                                                      const call_effects &calls) {
+        std::vector<std::set<int>> result;
+        std::set<int> frame = {ir::STACK_POINTER, ir::BASE_POINTER};
+        for (size_t i = 0; i < block.instrs.size(); i++) {
+            const ir::Instr &instr = block.instrs[i];
+            result.push_back(frame);
+            bool slot = instr.op == ir::ADD &&
+                        ((frame.contains(instr.reg[0]) && constants::value(states[i], instr.reg[1])) ||
+                         (frame.contains(instr.reg[1]) && constants::value(states[i], instr.reg[0])));
+            for (int reg : call_effects::defs(instr, &calls)) {
+                frame.erase(reg);
+            }
+            if (slot) {
+                frame.insert(instr.reg[2]);
+            }
+            // the frame code only moves the pointers within the stack
+            frame.insert({ir::STACK_POINTER, ir::BASE_POINTER});
+        }
+        return result;
+    }
+
+    /*
+     * Applies one instruction to the open windows
+     * @param frame - the registers that hold an address in the frame (see frame_registers)
+     * @param report - receives the violation if the instruction is an access outside a window, nullptr to only step
+     */
+    static void step(const ir::Function &function, size_t b, size_t i, const constants::State &state,
+                     const std::set<int> &frame, const std::set<uint64_t> &privileged, const cost_model &costs,
+                     Windows &windows, Report *report) {
+        const ir::Instr &instr = function.blocks[b].instrs[i];
+        switch (instr.op) {
+            case ir::LOAD:
+            case ir::STORE: {
+                auto addr = constants::value(state, instr.reg[0]);
+                if (!addr && !frame.contains(instr.reg[0]) && report) {
+                    report->unverified.push_back({function.name, b, i});
+                }
+                if (addr && privileged.contains(*addr) && report) {
+                    auto open = windows.find(*addr);
+                    int64_t needed = static_cast<int64_t>(costs.cycles[instr.op]);
+                    if (open == windows.end()) {
+                        report->violations.push_back({function.name, b, i, *addr, "no open window"});
+                    } else if (open->second < needed) {
+                        report->violations.push_back({function.name, b, i, *addr,
+                                                      "window ends " + std::to_string(needed - open->second) +
+                                                      " cycles too early"});
+                    }
+                }
+                elapse(windows, costs.cycles[instr.op]);
+                break;
+            }
+            case ir::REQUEST: {
+                auto addr = constants::value(state, instr.reg[0]);
+                auto cycles = window(instr, state);
+                elapse(windows, costs.instruction_cycles(instr, cycles.value_or(0)));
+                if (addr) {
+                    windows.erase(*addr);
+                    if (cycles) {
+                        windows[*addr] = static_cast<int64_t>(*cycles);
+                    }
+                }
+                break;
+            }
+            case ir::CALL:
+            case ir::RET:
+            case ir::EXIT:
+                windows.clear();
+                break;
+            default:
+                elapse(windows, costs.instruction_cycles(instr));
+                break;
+        }
+    }
+
+    static void verify(const ir::Function &function, const std::set<uint64_t> &privileged, const cost_model &costs,
+                       const call_effects &calls, Report &report) {
+        size_t n = function.blocks.size();
+        ir::CFG cfg(function);
+        constants consts(function, cfg, &calls);
+        std::vector<std::vector<constants::State>> states(n);
+        std::vector<std::vector<std::set<int>>> frames(n);
+        for (size_t b = 0; b < n; b++) {
+            states[b] = consts.states(function, b);
+            frames[b] = frame_registers(function.blocks[b], states[b], calls);
+        }
+
+        // the open windows at the start of every block, iterated to a fixpoint (windows only shrink)
+        std::vector<Windows> in(n), out(n);
+        std::vector<bool> visited(n, false);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t b = 0; b < n; b++) {
+                Windows windows;
+                bool first = b != 0; // no window is open at the entry
+                for (size_t p : cfg.predecessors[b]) {
+                    if (!visited[p]) {
+                        continue;
+                    }
+                    if (first) {
+                        windows = out[p];
+                        first = false;
+                    } else {
+                        meet(windows, out[p]);
+                    }
+                }
+                if (first) {
+                    continue; // not reached (yet)
+                }
+                in[b] = windows;
+                for (size_t i = 0; i < function.blocks[b].instrs.size(); i++) {
+                    step(function, b, i, states[b][i], frames[b][i], privileged, costs, windows, nullptr);
+                }
+                if (!visited[b] || windows != out[b]) {
+                    out[b] = std::move(windows);
+                    visited[b] = true;
+                    changed = true;
+                }
+            }
+        }
+
+        for (size_t b = 0; b < n; b++) {
+            if (!visited[b]) {
+                continue;
+            }
+            Windows windows = in[b];
+            for (size_t i = 0; i < function.blocks[b].instrs.size(); i++) {
+                const ir::Instr &instr = function.blocks[b].instrs[i];
+                step(function, b, i, states[b][i], frames[b][i], privileged, costs, windows, &report);
+                auto addr = constants::value(states[b][i], instr.reg[0]);
+                auto cycles = window(instr, states[b][i]);
+                if (instr.op == ir::REQUEST && addr && privileged.contains(*addr) && cycles) {
+                    auto needed = needed_cycles(function, cfg, states, costs, b, i, *addr);
+                    if (needed) {
+                        report.slack.push_back({function.name, b, i, *addr, *cycles, std::min(*cycles, *needed)});
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * The cycles the request at (block, index) has to grant for the accesses of addr after it: the longest distance
+     * from its end to the end of such an access, up to the next request of the address, a call, ret or exit.
+     * @return nullopt if the control flow goes backwards
+     */
+    static std::optional<uint64_t> needed_cycles(const ir::Function &function, const ir::CFG &cfg,
+                                                 const std::vector<std::vector<constants::State>> &states,
+                                                 const cost_model &costs, size_t block, size_t index, uint64_t addr) {
+        size_t n = function.blocks.size();
+        std::vector<std::optional<uint64_t>> entry(n);
+        uint64_t needed = 0;
+        auto walk = [&](size_t b, size_t start, uint64_t elapsed) {
+            const auto &instrs = function.blocks[b].instrs;
+            for (size_t i = start; i < instrs.size(); i++) {
+                const ir::Instr &instr = instrs[i];
+                auto instr_addr = constants::value(states[b][i], instr.reg[0]);
+                if ((instr.op == ir::LOAD || instr.op == ir::STORE) && instr_addr == addr) {
+                    needed = std::max(needed, costs.access_window(elapsed, instr));
+                }
+                if ((instr.op == ir::REQUEST && instr_addr == addr) || instr.op == ir::CALL || instr.op == ir::RET ||
+                    instr.op == ir::EXIT) {
+                    return true;
+                }
+                auto cycles = instr.op == ir::REQUEST ? window(instr, states[b][i]) : std::nullopt;
+                elapsed += costs.instruction_cycles(instr, cycles.value_or(0));
+            }
+            for (size_t s : cfg.successors[b]) {
+                if (s <= b) {
+                    return false;
+                }
+                entry[s] = std::max(entry[s].value_or(0), elapsed);
+            }
+            return true;
+        };
+        if (!walk(block, index + 1, 0)) {
+            return std::nullopt;
+        }
+        for (size_t b = block + 1; b < n; b++) {
+            if (entry[b] && !walk(b, 0, *entry[b])) {
+                return std::nullopt;
+            }
+        }
+        return needed;
+    }
+};
+
+#endif //VERIFIER_H
@@ -0,0 +1 @@
+#include "writer.h"
@@ -0,0 +1,172 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <string_view>
+#include <unistd.h>
+#include <vector>
+
+#include "bytecode.h"
+
+// Buffered output of programs
+//
+// Instructions are formatted straight into one large buffer that is reused for the whole output, the buffer is
+// handed to the kernel with a single write per flush. The writer works on any file descriptor, "-" is stdout, so the
+// compiler can be used in a pipeline without temporary files.
+
+class output_writer {
+public:
+    enum Format {
+        TEXT,  // one instruction per line, as in output.in
+        BINARY // encoded bytecode, see bytecode.h
+    };
+
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+private:
+    int fd = -1;
+    bool owns_fd = false;
+    bool failed = false;
+    std::vector<char> buffer;
+    size_t used = 0;
+
+    // makes sure size more bytes fit into the buffer
+    void reserve(size_t size) {
+        if (used + size > buffer.size()) {
+            flush();
+            if (size > buffer.size()) {
+                buffer.resize(size);
+            }
+        }
+    }
+
+    void put(std::string_view text) {
+        reserve(text.size());
+        memcpy(buffer.data() + used, text.data(), text.size());
+        used += text.size();
+    }
+
+    void put_number(uint64_t value) {
+        reserve(20);
+        auto result = std::to_chars(buffer.data() + used, buffer.data() + buffer.size(), value);
+        used = result.ptr - buffer.data();
+    }
+
+public:
+    output_writer() : buffer(BUFFER_SIZE) {}
+
+    explicit output_writer(int fd) : fd(fd), buffer(BUFFER_SIZE) {}
+
+    output_writer(const output_writer &) = delete;
+    output_writer &operator=(const output_writer &) = delete;
+
+    ~output_writer() {
+        close();
+    }
+
+    /*
+     * Opens the output, "-" is stdout
+     * @param path - the file to (over)write
+     * @return bool - false if the file cannot be opened
+     */
+    bool open(const char *path) {
+        close();
+        if (strcmp(path, "-") == 0) {
+            fd = STDOUT_FILENO;
+            owns_fd = false;
+        } else {
+            fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            owns_fd = true;
+        }
+        failed = fd < 0;
+        if (failed) {
+            fprintf(stderr, "Error: could not open %s\n", path);
+        }
+        return !failed;
+    }
+
+    bool is_stdout() const {
+        return fd == STDOUT_FILENO;
+    }
+
+    // false if opening or a write failed
+    bool ok() const {
+        return !failed;
+    }
+
+    void write(std::string_view text) {
+        put(text);
+    }
+
+    // writes one instruction in text form, including the new line
+    void write_text(const bytecode::Instruction &instruction) {
+        reserve(32);
+        put(bytecode::mnemonic(instruction.op));
+        for (int i = 0; i < bytecode::register_count(instruction.op); i++) {
+            buffer[used++] = ' ';
+            buffer[used++] = static_cast<char>('0' + instruction.reg[i]);
+        }
+        if (instruction.op == bytecode::LI) {
+            buffer[used++] = ' ';
+            put_number(instruction.imm);
+        }
+        buffer[used++] = '\n';
+    }
+
+    void write_binary(const bytecode::Instruction &instruction) {
+        reserve(bytecode::MAX_INSTRUCTION_SIZE);
+        used += bytecode::encode(instruction, reinterpret_cast<uint8_t *>(buffer.data() + used));
+    }
+
+    // writes a whole program in the given format
+    void write_program(const std::vector<bytecode::Instruction> &program, Format format) {
+        if (format == BINARY) {
+            reserve(bytecode::HEADER_SIZE + 10);
+            used += bytecode::encode_header(program.size(), reinterpret_cast<uint8_t *>(buffer.data() + used));
+            for (const auto &instruction : program) {
+                write_binary(instruction);
+            }
+        } else {
+            for (const auto &instruction : program) {
+                write_text(instruction);
+            }
+        }
+    }
+
+    // hands the buffered bytes to the kernel, the buffer is reused afterwards
+    bool flush() {
+        size_t written = 0;
+        while (written < used && !failed) {
+            ssize_t result = ::write(fd, buffer.data() + written, used - written);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result <= 0) {
+                fprintf(stderr, "Error: could not write output\n");
+                failed = true;
+                break;
+            }
+            written += result;
+        }
+        used = 0;
+        return !failed;
+    }
+
+    bool close() {
+        bool result = true;
+        if (fd >= 0) {
+            result = flush();
+            if (owns_fd) {
+                ::close(fd);
+            }
+        }
+        fd = -1;
+        owns_fd = false;
+        return result && !failed;
+    }
+};
+
+#endif //WRITER_H